@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "allocation-counter.hpp"
+
+#include <cerrno>
+#include <cstddef>
+
+#ifdef COUNT_ALLOCATIONS
+
+// The allocator of glibc under its internal names, which the replacements below forward to.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+}
+
+namespace {
+// Plain integer so that it is constant-initialised and safe to touch from malloc on any thread.
+thread_local uint64_t threadAllocations = 0;
+
+bool validAlignment(size_t alignment) {
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
+}
+
+uint64_t allocationCount() {
+    return threadAllocations;
+}
+
+// malloc and its relatives are replaced rather than operator new: cv::Mat gets its buffers from cv::fastMalloc()
+// and OpenCV its scratch buffers from malloc, which operator new never sees. operator new of libstdc++ calls
+// malloc, so the containers of the service are still counted, once. glibc also calls the replacements internally.
+extern "C" {
+
+void *malloc(size_t size) {
+    threadAllocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    threadAllocations++;
+    return __libc_calloc(count, size);
+}
+
+// realloc(p, 0) only frees
+void *realloc(void *p, size_t size) {
+    if (size != 0) {
+        threadAllocations++;
+    }
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    threadAllocations++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) {
+    if (!validAlignment(alignment) || alignment % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *allocated = memalign(alignment, size);
+    if (allocated == nullptr) {
+        return ENOMEM;
+    }
+    *p = allocated;
+    return 0;
+}
+
+}
+
+#endif
+
+FrameAllocations::FrameAllocations()
+    : m_stages()
+    , m_counts()
+    , m_size(0)
+    , m_last(0)
+    , m_extra(0) {}
+
+void FrameAllocations::begin() {
+    m_size = 0;
+    m_last = allocationCount();
+    m_extra = 0;
+}
+
+void FrameAllocations::resume() {
+    m_last = allocationCount();
+}
+
+void FrameAllocations::add(uint64_t count) {
+    m_extra += count;
+}
+
+void FrameAllocations::mark(const char *stage) {
+    const uint64_t now = allocationCount();
+    if (m_size < MAX_STAGES) {
+        m_stages[m_size] = stage;
+        m_counts[m_size] = now - m_last + m_extra;
+        m_size++;
+    }
+    m_last = now;
+    m_extra = 0;
+}
+
+uint64_t FrameAllocations::total() const {
+    uint64_t sum = 0;
+    for (int i = 0; i < m_size; i++) {
+        sum += m_counts[i];
+    }
+    return sum;
+}
+
+void FrameAllocations::print(std::ostream &out) const {
+    out << total() << " (";
+    for (int i = 0; i < m_size; i++) {
+        out << (i == 0 ? "" : " ") << m_stages[i] << "=" << m_counts[i];
+    }
+    out << ")";
+}
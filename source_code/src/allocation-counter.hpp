@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLOCATION_COUNTER_HPP
+#define ALLOCATION_COUNTER_HPP
+
+#include <cstdint>
+#include <ostream>
+
+// Counts the heap allocations made by the calling thread: malloc, calloc, realloc and the aligned variants,
+// which also covers operator new and the buffers of cv::Mat. The counter replaces these functions of glibc
+// and is only compiled in with -D COUNT_ALLOCATIONS=ON; otherwise allocationCount() always returns 0.
+#ifdef COUNT_ALLOCATIONS
+const bool ALLOCATION_COUNTER_ENABLED = true;
+uint64_t allocationCount();
+#else
+const bool ALLOCATION_COUNTER_ENABLED = false;
+inline uint64_t allocationCount() {
+    return 0;
+}
+#endif
+
+// Splits the allocations of one frame by stage: mark() charges everything since the previous mark
+// (or since begin() or resume()) to the named stage. Stage names must be string literals.
+// A frame that moves to another thread continues with resume() on that thread, since the counter is per thread.
+class FrameAllocations {
+   public:
+    FrameAllocations();
+
+    void begin();
+    void resume();
+    // Charges allocations made on a helper thread to the next mark().
+    void add(uint64_t count);
+    void mark(const char *stage);
+    uint64_t total() const;
+    // Prints "<total> (<stage>=<count> ...)" without allocating.
+    void print(std::ostream &out) const;
+
+   private:
+    static const int MAX_STAGES = 16;
+    const char *m_stages[MAX_STAGES];
+    uint64_t m_counts[MAX_STAGES];
+    int m_size;
+    uint64_t m_last;
+    uint64_t m_extra;
+};
+
+#endif
@@ -0,0 +1,741 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cone-segmentation.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <cmath>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONE_SEGMENTATION_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// OpenCV computes 8-bit HSV in fixed point with 12 fractional bits and two reciprocal tables.
+const int HSV_SHIFT = 12;
+
+struct HsvTables {
+    int sdiv[256];
+    int hdiv[256];
+
+    HsvTables() : sdiv(), hdiv() {
+        for (int i = 1; i < 256; i++) {
+            // Same rounding as saturate_cast<int>(double), i.e. round half to even.
+            sdiv[i] = static_cast<int>(std::lrint((255 << HSV_SHIFT) / (1.0 * i)));
+            hdiv[i] = static_cast<int>(std::lrint((180 << HSV_SHIFT) / (6.0 * i)));
+        }
+    }
+};
+
+const HsvTables &hsvTables() {
+    static const HsvTables tables;
+    return tables;
+}
+
+inline bool inRange(const HsvRange &range, int h, int s, int v) {
+    return h >= range.minHue && h <= range.maxHue &&
+           s >= range.minSat && s <= range.maxSat &&
+           v >= range.minVal && v <= range.maxVal;
+}
+
+#ifdef CONE_SEGMENTATION_X86
+
+// The SIMD kernels follow bgrToHsv() step by step on 32-bit lanes, one lane per BGRA pixel, so that the
+// masks stay bit-identical. Hue never exceeds 180 here, which is why the final clamp is not needed.
+
+__attribute__((target("sse4.1")))
+inline __m128i gatherSse41(const int *table, __m128i index) {
+    // SSE4.1 has no gather instruction; four scalar loads are still cheaper than the rest of the pixel.
+    return _mm_setr_epi32(table[_mm_extract_epi32(index, 0)], table[_mm_extract_epi32(index, 1)],
+                          table[_mm_extract_epi32(index, 2)], table[_mm_extract_epi32(index, 3)]);
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i inRangeSse41(__m128i value, int minValue, int maxValue) {
+    const __m128i below = _mm_cmpgt_epi32(_mm_set1_epi32(minValue), value);
+    const __m128i above = _mm_cmpgt_epi32(value, _mm_set1_epi32(maxValue));
+    return _mm_or_si128(below, above);
+}
+
+// Classifies four BGRA pixels; returns the blue and the yellow result as all-ones/zero 32-bit lanes.
+__attribute__((target("sse4.1")))
+inline void classifySse41(__m128i pixels, const HsvRange &blue, const HsvRange &yellow,
+                          __m128i &blueLanes, __m128i &yellowLanes) {
+    const HsvTables &tables = hsvTables();
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i b = _mm_and_si128(pixels, byteMask);
+    const __m128i g = _mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask);
+    const __m128i r = _mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask);
+
+    const __m128i v = _mm_max_epi32(b, _mm_max_epi32(g, r));
+    const __m128i vmin = _mm_min_epi32(b, _mm_min_epi32(g, r));
+    const __m128i diff = _mm_sub_epi32(v, vmin);
+    const __m128i vr = _mm_cmpeq_epi32(v, r);
+    const __m128i vg = _mm_cmpeq_epi32(v, g);
+    const __m128i round = _mm_set1_epi32(1 << (HSV_SHIFT - 1));
+
+    const __m128i s = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(diff, gatherSse41(tables.sdiv, v)), round), HSV_SHIFT);
+
+    const __m128i hueR = _mm_sub_epi32(g, b);
+    const __m128i hueG = _mm_add_epi32(_mm_sub_epi32(b, r), _mm_slli_epi32(diff, 1));
+    const __m128i hueB = _mm_add_epi32(_mm_sub_epi32(r, g), _mm_slli_epi32(diff, 2));
+    __m128i h = _mm_add_epi32(_mm_and_si128(vr, hueR),
+                              _mm_andnot_si128(vr, _mm_add_epi32(_mm_and_si128(vg, hueG), _mm_andnot_si128(vg, hueB))));
+    h = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(h, gatherSse41(tables.hdiv, diff)), round), HSV_SHIFT);
+    h = _mm_add_epi32(h, _mm_and_si128(_mm_cmpgt_epi32(_mm_setzero_si128(), h), _mm_set1_epi32(180)));
+
+    const __m128i blueOut = _mm_or_si128(inRangeSse41(h, blue.minHue, blue.maxHue),
+                            _mm_or_si128(inRangeSse41(s, blue.minSat, blue.maxSat), inRangeSse41(v, blue.minVal, blue.maxVal)));
+    const __m128i yellowOut = _mm_or_si128(inRangeSse41(h, yellow.minHue, yellow.maxHue),
+                              _mm_or_si128(inRangeSse41(s, yellow.minSat, yellow.maxSat), inRangeSse41(v, yellow.minVal, yellow.maxVal)));
+    const __m128i ones = _mm_set1_epi32(-1);
+    blueLanes = _mm_xor_si128(blueOut, ones);
+    yellowLanes = _mm_xor_si128(yellowOut, ones);
+}
+
+// Eight pixels (32 bytes) per iteration, stored as eight mask bytes per colour.
+__attribute__((target("sse4.1")))
+void segmentRowSse41(const uint8_t *src, int width, const HsvRange &blue, const HsvRange &yellow,
+                     uint8_t *blueRow, uint8_t *yellowRow) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i blueLo, yellowLo, blueHi, yellowHi;
+        classifySse41(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * x)), blue, yellow, blueLo, yellowLo);
+        classifySse41(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * x + 16)), blue, yellow, blueHi, yellowHi);
+        const __m128i blueBytes = _mm_packs_epi16(_mm_packs_epi32(blueLo, blueHi), _mm_setzero_si128());
+        const __m128i yellowBytes = _mm_packs_epi16(_mm_packs_epi32(yellowLo, yellowHi), _mm_setzero_si128());
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(blueRow + x), blueBytes);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(yellowRow + x), yellowBytes);
+    }
+    segmentRowScalar(src + 4 * x, 4, width - x, blue, yellow, blueRow + x, yellowRow + x);
+}
+
+__attribute__((target("avx2")))
+inline __m256i inRangeAvx2(__m256i value, int minValue, int maxValue) {
+    const __m256i below = _mm256_cmpgt_epi32(_mm256_set1_epi32(minValue), value);
+    const __m256i above = _mm256_cmpgt_epi32(value, _mm256_set1_epi32(maxValue));
+    return _mm256_or_si256(below, above);
+}
+
+// Classifies eight BGRA pixels; same steps as classifySse41() with hardware gathers for the tables.
+__attribute__((target("avx2")))
+inline void classifyAvx2(__m256i pixels, const HsvRange &blue, const HsvRange &yellow,
+                         __m256i &blueLanes, __m256i &yellowLanes) {
+    const HsvTables &tables = hsvTables();
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i b = _mm256_and_si256(pixels, byteMask);
+    const __m256i g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask);
+    const __m256i r = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask);
+
+    const __m256i v = _mm256_max_epi32(b, _mm256_max_epi32(g, r));
+    const __m256i vmin = _mm256_min_epi32(b, _mm256_min_epi32(g, r));
+    const __m256i diff = _mm256_sub_epi32(v, vmin);
+    const __m256i vr = _mm256_cmpeq_epi32(v, r);
+    const __m256i vg = _mm256_cmpeq_epi32(v, g);
+    const __m256i round = _mm256_set1_epi32(1 << (HSV_SHIFT - 1));
+
+    const __m256i sdiv = _mm256_i32gather_epi32(tables.sdiv, v, 4);
+    const __m256i s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, sdiv), round), HSV_SHIFT);
+
+    const __m256i hueR = _mm256_sub_epi32(g, b);
+    const __m256i hueG = _mm256_add_epi32(_mm256_sub_epi32(b, r), _mm256_slli_epi32(diff, 1));
+    const __m256i hueB = _mm256_add_epi32(_mm256_sub_epi32(r, g), _mm256_slli_epi32(diff, 2));
+    __m256i h = _mm256_add_epi32(_mm256_and_si256(vr, hueR),
+                                 _mm256_andnot_si256(vr, _mm256_add_epi32(_mm256_and_si256(vg, hueG), _mm256_andnot_si256(vg, hueB))));
+    const __m256i hdiv = _mm256_i32gather_epi32(tables.hdiv, diff, 4);
+    h = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(h, hdiv), round), HSV_SHIFT);
+    h = _mm256_add_epi32(h, _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), h), _mm256_set1_epi32(180)));
+
+    const __m256i blueOut = _mm256_or_si256(inRangeAvx2(h, blue.minHue, blue.maxHue),
+                            _mm256_or_si256(inRangeAvx2(s, blue.minSat, blue.maxSat), inRangeAvx2(v, blue.minVal, blue.maxVal)));
+    const __m256i yellowOut = _mm256_or_si256(inRangeAvx2(h, yellow.minHue, yellow.maxHue),
+                              _mm256_or_si256(inRangeAvx2(s, yellow.minSat, yellow.maxSat), inRangeAvx2(v, yellow.minVal, yellow.maxVal)));
+    const __m256i ones = _mm256_set1_epi32(-1);
+    blueLanes = _mm256_xor_si256(blueOut, ones);
+    yellowLanes = _mm256_xor_si256(yellowOut, ones);
+}
+
+// Packs sixteen 32-bit lanes (two registers of eight pixels) into sixteen mask bytes in pixel order.
+__attribute__((target("avx2")))
+inline __m128i packLanesAvx2(__m256i lo, __m256i hi) {
+    // packs works per 128-bit half, so the words come out as lo0 hi0 lo1 hi1 and are put back in order.
+    const __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    const __m256i bytes = _mm256_packs_epi16(words, _mm256_setzero_si256());
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(bytes, 0xD8));
+}
+
+// Sixteen pixels (64 bytes) per iteration, stored as sixteen mask bytes per colour.
+__attribute__((target("avx2")))
+void segmentRowAvx2(const uint8_t *src, int width, const HsvRange &blue, const HsvRange &yellow,
+                    uint8_t *blueRow, uint8_t *yellowRow) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i blueLo, yellowLo, blueHi, yellowHi;
+        classifyAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * x)), blue, yellow, blueLo, yellowLo);
+        classifyAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 4 * x + 32)), blue, yellow, blueHi, yellowHi);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(blueRow + x), packLanesAvx2(blueLo, blueHi));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(yellowRow + x), packLanesAvx2(yellowLo, yellowHi));
+    }
+    segmentRowScalar(src + 4 * x, 4, width - x, blue, yellow, blueRow + x, yellowRow + x);
+}
+
+#endif
+
+}
+
+SegmentationKernel detectSegmentationKernel() {
+#ifdef CONE_SEGMENTATION_X86
+    static const SegmentationKernel detected = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SegmentationKernel::Avx2;
+        }
+        if (__builtin_cpu_supports("sse4.1")) {
+            return SegmentationKernel::Sse41;
+        }
+        return SegmentationKernel::Scalar;
+    }();
+    return detected;
+#else
+    return SegmentationKernel::Scalar;
+#endif
+}
+
+bool segmentationKernelSupported(SegmentationKernel kernel) {
+    switch (kernel) {
+        case SegmentationKernel::Avx2:
+            return detectSegmentationKernel() == SegmentationKernel::Avx2;
+        case SegmentationKernel::Sse41:
+            return detectSegmentationKernel() != SegmentationKernel::Scalar;
+        default:
+            return true;
+    }
+}
+
+const char *segmentationKernelName(SegmentationKernel kernel) {
+    switch (kernel) {
+        case SegmentationKernel::Avx2:
+            return "avx2";
+        case SegmentationKernel::Sse41:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+bool parseSegmentationKernel(const std::string &name, SegmentationKernel &kernel) {
+    if (name == "auto") {
+        kernel = detectSegmentationKernel();
+    } else if (name == "scalar") {
+        kernel = SegmentationKernel::Scalar;
+    } else if (name == "sse4.1") {
+        kernel = SegmentationKernel::Sse41;
+    } else if (name == "avx2") {
+        kernel = SegmentationKernel::Avx2;
+    } else {
+        return false;
+    }
+    return segmentationKernelSupported(kernel);
+}
+
+void bgrToHsv(uint8_t b, uint8_t g, uint8_t r, int &h, int &s, int &v) {
+    const HsvTables &tables = hsvTables();
+    int vmin = b;
+    v = b;
+    v = v < g ? g : v;
+    v = v < r ? r : v;
+    vmin = vmin > g ? g : vmin;
+    vmin = vmin > r ? r : vmin;
+
+    const int diff = v - vmin;
+    const int vr = v == r ? -1 : 0;
+    const int vg = v == g ? -1 : 0;
+
+    s = (diff * tables.sdiv[v] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    h = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + ((~vg) & (r - g + 4 * diff))));
+    h = (h * tables.hdiv[diff] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    h += h < 0 ? 180 : 0;
+    h = h > 255 ? 255 : h;
+}
+
+void segmentRowScalar(const uint8_t *src, int channels, int width, const HsvRange &blue, const HsvRange &yellow,
+                      uint8_t *blueRow, uint8_t *yellowRow) {
+    for (int x = 0; x < width; x++, src += channels) {
+        int h, s, v;
+        bgrToHsv(src[0], src[1], src[2], h, s, v);
+        blueRow[x] = inRange(blue, h, s, v) ? 255 : 0;
+        yellowRow[x] = inRange(yellow, h, s, v) ? 255 : 0;
+    }
+}
+
+namespace {
+
+void segmentRow(SegmentationKernel kernel, const uint8_t *src, int channels, int width, const HsvRange &blue,
+                const HsvRange &yellow, uint8_t *blueRow, uint8_t *yellowRow) {
+    switch (kernel) {
+#ifdef CONE_SEGMENTATION_X86
+        case SegmentationKernel::Avx2:
+            segmentRowAvx2(src, width, blue, yellow, blueRow, yellowRow);
+            break;
+        case SegmentationKernel::Sse41:
+            segmentRowSse41(src, width, blue, yellow, blueRow, yellowRow);
+            break;
+#endif
+        default:
+            segmentRowScalar(src, channels, width, blue, yellow, blueRow, yellowRow);
+            break;
+    }
+}
+
+inline void addColumns(const uint8_t *maskRow, int width, int *columns) {
+    for (int x = 0; x < width; x++) {
+        columns[x] += maskRow[x] != 0;
+    }
+}
+
+}  // namespace
+
+void segmentConesFused(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                       cv::Mat &blueMask, cv::Mat &yellowMask, SegmentationKernel kernel, std::vector<int> *blueColumns) {
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4));
+    blueMask.create(image.rows, image.cols, CV_8UC1);
+    yellowMask.create(image.rows, image.cols, CV_8UC1);
+    if (image.channels() != 4) {
+        kernel = SegmentationKernel::Scalar;
+    }
+    if (blueColumns != nullptr) {
+        blueColumns->assign(image.cols, 0);
+    }
+
+    for (int y = 0; y < image.rows; y++) {
+        uint8_t *blueRow = blueMask.ptr<uint8_t>(y);
+        segmentRow(kernel, image.ptr<uint8_t>(y), image.channels(), image.cols, blue, yellow,
+                   blueRow, yellowMask.ptr<uint8_t>(y));
+        if (blueColumns != nullptr) {
+            addColumns(blueRow, image.cols, blueColumns->data());
+        }
+    }
+}
+
+void segmentConesFusedPacked(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                             PackedMask &blueMask, PackedMask &yellowMask, SegmentationKernel kernel,
+                             std::vector<int> *blueColumns) {
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4));
+    blueMask.create(image.rows, image.cols);
+    yellowMask.create(image.rows, image.cols);
+    if (image.channels() != 4) {
+        kernel = SegmentationKernel::Scalar;
+    }
+    if (blueColumns != nullptr) {
+        blueColumns->assign(image.cols, 0);
+    }
+
+    const int channels = image.channels();
+    uint8_t blueBytes[64];
+    uint8_t yellowBytes[64];
+    for (int y = 0; y < image.rows; y++) {
+        const uint8_t *src = image.ptr<uint8_t>(y);
+        uint64_t *blueRow = blueMask.row(y);
+        uint64_t *yellowRow = yellowMask.row(y);
+        for (int x = 0; x < image.cols; x += 64) {
+            const int width = (image.cols - x < 64) ? image.cols - x : 64;
+            segmentRow(kernel, src + channels * x, channels, width, blue, yellow, blueBytes, yellowBytes);
+            packRow(blueBytes, width, blueRow + x / 64);
+            packRow(yellowBytes, width, yellowRow + x / 64);
+            if (blueColumns != nullptr) {
+                addColumns(blueBytes, width, blueColumns->data() + x);
+            }
+        }
+    }
+}
+
+void segmentConesSampled(const cv::Mat &image, int step, const HsvRange &blue, const HsvRange &yellow,
+                         cv::Mat &blueMask, cv::Mat &yellowMask, std::vector<int> *blueColumns) {
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4) && step >= 1);
+    const int rows = (image.rows + step - 1) / step;
+    const int cols = (image.cols + step - 1) / step;
+    blueMask.create(rows, cols, CV_8UC1);
+    yellowMask.create(rows, cols, CV_8UC1);
+    if (blueColumns != nullptr) {
+        blueColumns->assign(cols, 0);
+    }
+
+    //The scalar kernel only reads the first three bytes of a pixel, so a stride of step pixels skips the others
+    for (int y = 0; y < rows; y++) {
+        uint8_t *blueRow = blueMask.ptr<uint8_t>(y);
+        segmentRowScalar(image.ptr<uint8_t>(y * step), image.channels() * step, cols, blue, yellow,
+                         blueRow, yellowMask.ptr<uint8_t>(y));
+        if (blueColumns != nullptr) {
+            addColumns(blueRow, cols, blueColumns->data());
+        }
+    }
+}
+
+void countColumns(const cv::Mat &mask, std::vector<int> &columns) {
+    CV_Assert(mask.type() == CV_8UC1);
+    columns.assign(mask.cols, 0);
+    for (int y = 0; y < mask.rows; y++) {
+        addColumns(mask.ptr<uint8_t>(y), mask.cols, columns.data());
+    }
+}
+
+int countSegmentationMismatches(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                                const cv::Mat &blueMask, const cv::Mat &yellowMask) {
+    std::vector<uint8_t> blueRef(static_cast<size_t>(image.cols));
+    std::vector<uint8_t> yellowRef(static_cast<size_t>(image.cols));
+    int mismatches = 0;
+    for (int y = 0; y < image.rows; y++) {
+        segmentRowScalar(image.ptr<uint8_t>(y), image.channels(), image.cols, blue, yellow, blueRef.data(), yellowRef.data());
+        const uint8_t *blueRow = blueMask.ptr<uint8_t>(y);
+        const uint8_t *yellowRow = yellowMask.ptr<uint8_t>(y);
+        for (int x = 0; x < image.cols; x++) {
+            mismatches += (blueRow[x] != blueRef[static_cast<size_t>(x)]) + (yellowRow[x] != yellowRef[static_cast<size_t>(x)]);
+        }
+    }
+    return mismatches;
+}
+
+ConeColorLut::ConeColorLut()
+    : m_table()
+    , m_blue{0, 0, 0, -1, -1, -1}
+    , m_yellow{0, 0, 0, -1, -1, -1}
+    , m_error(0.0) {}
+
+bool ConeColorLut::update(const HsvRange &blue, const HsvRange &yellow) {
+    const auto same = [](const HsvRange &a, const HsvRange &b) {
+        return a.minHue == b.minHue && a.minSat == b.minSat && a.minVal == b.minVal &&
+               a.maxHue == b.maxHue && a.maxSat == b.maxSat && a.maxVal == b.maxVal;
+    };
+    if (!m_table.empty() && same(blue, m_blue) && same(yellow, m_yellow)) {
+        return false;
+    }
+    build(blue, yellow);
+    return true;
+}
+
+double ConeColorLut::quantisationError() const {
+    return m_error;
+}
+
+void ConeColorLut::build(const HsvRange &blue, const HsvRange &yellow) {
+    m_blue = blue;
+    m_yellow = yellow;
+    m_table.assign(64 * 64 * 64 / 4, 0);
+
+    // Vote over the 4x4x4 exact colours of every cell; blue and yellow only overlap if the bounds do,
+    // in which case blue wins like it would in the steering code that looks at the blue cones first.
+    uint64_t wrong = 0;
+    for (uint32_t cell = 0; cell < 64 * 64 * 64; cell++) {
+        const int b0 = static_cast<int>((cell >> 12) & 63) << 2;
+        const int g0 = static_cast<int>((cell >> 6) & 63) << 2;
+        const int r0 = static_cast<int>(cell & 63) << 2;
+        int votes[3] = {0, 0, 0};
+        for (int b = b0; b < b0 + 4; b++) {
+            for (int g = g0; g < g0 + 4; g++) {
+                for (int r = r0; r < r0 + 4; r++) {
+                    int h, s, v;
+                    bgrToHsv(static_cast<uint8_t>(b), static_cast<uint8_t>(g), static_cast<uint8_t>(r), h, s, v);
+                    votes[inRange(blue, h, s, v) ? Blue : (inRange(yellow, h, s, v) ? Yellow : None)]++;
+                }
+            }
+        }
+        int best = None;
+        if (votes[Blue] > votes[best]) {
+            best = Blue;
+        }
+        if (votes[Yellow] > votes[best]) {
+            best = Yellow;
+        }
+        wrong += static_cast<uint64_t>(64 - votes[best]);
+        m_table[cell >> 2] = static_cast<uint8_t>(m_table[cell >> 2] | (best << ((cell & 3) * 2)));
+    }
+    m_error = static_cast<double>(wrong) / static_cast<double>(1 << 24);
+}
+
+void ConeColorLut::segment(const cv::Mat &image, cv::Mat &blueMask, cv::Mat &yellowMask, std::vector<int> *blueColumns) const {
+    CV_Assert(!m_table.empty() && image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4));
+    blueMask.create(image.rows, image.cols, CV_8UC1);
+    yellowMask.create(image.rows, image.cols, CV_8UC1);
+    if (blueColumns != nullptr) {
+        blueColumns->assign(image.cols, 0);
+    }
+
+    const int channels = image.channels();
+    for (int y = 0; y < image.rows; y++) {
+        const uint8_t *src = image.ptr<uint8_t>(y);
+        uint8_t *blueRow = blueMask.ptr<uint8_t>(y);
+        uint8_t *yellowRow = yellowMask.ptr<uint8_t>(y);
+        for (int x = 0; x < image.cols; x++, src += channels) {
+            const uint8_t cls = classify(src[0], src[1], src[2]);
+            blueRow[x] = cls == Blue ? 255 : 0;
+            yellowRow[x] = cls == Yellow ? 255 : 0;
+        }
+        if (blueColumns != nullptr) {
+            addColumns(blueRow, image.cols, blueColumns->data());
+        }
+    }
+}
+
+void ConeColorLut::segmentPacked(const cv::Mat &image, PackedMask &blueMask, PackedMask &yellowMask,
+                                 std::vector<int> *blueColumns) const {
+    CV_Assert(!m_table.empty() && image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4));
+    blueMask.create(image.rows, image.cols);
+    yellowMask.create(image.rows, image.cols);
+    if (blueColumns != nullptr) {
+        blueColumns->assign(image.cols, 0);
+    }
+
+    const int channels = image.channels();
+    for (int y = 0; y < image.rows; y++) {
+        const uint8_t *src = image.ptr<uint8_t>(y);
+        uint64_t *blueRow = blueMask.row(y);
+        uint64_t *yellowRow = yellowMask.row(y);
+        for (int i = 0; i < blueMask.wordsPerRow(); i++) {
+            const int end = (image.cols - i * 64 < 64) ? image.cols - i * 64 : 64;
+            uint64_t blueWord = 0;
+            uint64_t yellowWord = 0;
+            for (int bit = 0; bit < end; bit++, src += channels) {
+                const uint8_t cls = classify(src[0], src[1], src[2]);
+                blueWord |= static_cast<uint64_t>(cls == Blue) << bit;
+                yellowWord |= static_cast<uint64_t>(cls == Yellow) << bit;
+                if (blueColumns != nullptr) {
+                    (*blueColumns)[i * 64 + bit] += cls == Blue;
+                }
+            }
+            blueRow[i] = blueWord;
+            yellowRow[i] = yellowWord;
+        }
+    }
+}
+
+const char *maskCleanupName(MaskCleanup cleanup) {
+    switch (cleanup) {
+        case MaskCleanup::Morphology:
+            return "morphology";
+        case MaskCleanup::Components:
+            return "components";
+        default:
+            return "canny";
+    }
+}
+
+MaskCleanup parseMaskCleanup(const std::string &name) {
+    if (name == "morphology") {
+        return MaskCleanup::Morphology;
+    }
+    if (name == "components") {
+        return MaskCleanup::Components;
+    }
+    return MaskCleanup::Canny;
+}
+
+void openCloseMask(const cv::Mat &mask, cv::Mat &opened, cv::Mat &cleaned) {
+    // An empty kernel is OpenCV's 3x3 square.
+    cv::morphologyEx(mask, opened, cv::MORPH_OPEN, cv::Mat());
+    cv::morphologyEx(opened, cleaned, cv::MORPH_CLOSE, cv::Mat());
+}
+
+void removeSmallComponents(const cv::Mat &mask, int minArea, ComponentBuffers &buffers, cv::Mat &cleaned) {
+    const int count = cv::connectedComponentsWithStats(mask, buffers.labels, buffers.stats, buffers.centroids, 8, CV_32S);
+    // One byte per label, so that the relabelling below is a plain table lookup.
+    buffers.keep.resize(static_cast<size_t>(count));
+    buffers.keep[0] = 0;
+    for (int i = 1; i < count; i++) {
+        buffers.keep[i] = buffers.stats.at<int>(i, cv::CC_STAT_AREA) >= minArea ? 255 : 0;
+    }
+
+    cleaned.create(mask.size(), CV_8UC1);
+    for (int y = 0; y < mask.rows; y++) {
+        const int *labelRow = buffers.labels.ptr<int>(y);
+        uint8_t *cleanedRow = cleaned.ptr<uint8_t>(y);
+        for (int x = 0; x < mask.cols; x++) {
+            cleanedRow[x] = buffers.keep[labelRow[x]];
+        }
+    }
+}
+
+void extractBlobs(const cv::Mat &mask, int minArea, size_t maxBlobs, cv::Point offset, ComponentBuffers &buffers,
+                  std::vector<ConeBlob> &blobs) {
+    const int count = cv::connectedComponentsWithStats(mask, buffers.labels, buffers.stats, buffers.centroids, 8, CV_32S);
+    blobs.clear();
+    // The labels are numbered in raster order of the first pixel of each blob, which is where findContours()
+    // starts a contour as well. It returns the contours the other way round, so the labels are walked backwards.
+    for (int i = count - 1; i >= 1 && blobs.size() < maxBlobs; i--) {
+        const int *stat = buffers.stats.ptr<int>(i);
+        if (stat[cv::CC_STAT_AREA] < minArea) {
+            continue;
+        }
+        const double *centroid = buffers.centroids.ptr<double>(i);
+        ConeBlob blob;
+        blob.area = stat[cv::CC_STAT_AREA];
+        blob.centroid = cv::Point2f(static_cast<float>(centroid[0] + offset.x), static_cast<float>(centroid[1] + offset.y));
+        blob.box = cv::Rect(stat[cv::CC_STAT_LEFT] + offset.x, stat[cv::CC_STAT_TOP] + offset.y,
+                            stat[cv::CC_STAT_WIDTH], stat[cv::CC_STAT_HEIGHT]);
+        blobs.push_back(blob);
+    }
+}
+
+namespace {
+
+inline int countTrailingZeros(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int count = 0;
+    for (; (word & 1) == 0; word >>= 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+// First x at or after from whose bit is set (or clear), cols if there is none.
+int nextBit(const uint64_t *row, int from, int cols, bool set) {
+    for (int x = from; x < cols; x = ((x >> 6) + 1) << 6) {
+        uint64_t word = set ? row[x >> 6] : ~row[x >> 6];
+        word &= ~static_cast<uint64_t>(0) << (x & 63);
+        if (word != 0) {
+            const int found = ((x >> 6) << 6) + countTrailingZeros(word);
+            return found < cols ? found : cols;
+        }
+    }
+    return cols;
+}
+
+int findRoot(std::vector<MaskRun> &runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+// The root of a blob is always its run with the smallest index, i.e. the one with its first pixel.
+void joinRuns(std::vector<MaskRun> &runs, int a, int b) {
+    const int rootA = findRoot(runs, a);
+    const int rootB = findRoot(runs, b);
+    if (rootA < rootB) {
+        runs[rootB].parent = rootA;
+    } else if (rootB < rootA) {
+        runs[rootA].parent = rootB;
+    }
+}
+
+}  // namespace
+
+void extractBlobs(const PackedMask &mask, int minArea, size_t maxBlobs, cv::Point offset, ComponentBuffers &buffers,
+                  std::vector<ConeBlob> &blobs) {
+    std::vector<MaskRun> &runs = buffers.runs;
+    std::vector<int> &rowStarts = buffers.rowStarts;
+    runs.clear();
+    //A row has at most one run per two pixels; reserving that keeps a busier frame from reallocating
+    runs.reserve(static_cast<size_t>(mask.rows()) * static_cast<size_t>((mask.cols() + 1) / 2));
+    rowStarts.resize(static_cast<size_t>(mask.rows()) + 1);
+
+    for (int y = 0; y < mask.rows(); y++) {
+        rowStarts[y] = static_cast<int>(runs.size());
+        const uint64_t *row = mask.row(y);
+        for (int x = nextBit(row, 0, mask.cols(), true); x < mask.cols(); x = nextBit(row, x, mask.cols(), true)) {
+            MaskRun run;
+            run.y = y;
+            run.x0 = x;
+            run.x1 = nextBit(row, x, mask.cols(), false);
+            run.parent = static_cast<int>(runs.size());
+            runs.push_back(run);
+            x = run.x1;
+        }
+
+        // 8-connected: a run touches the runs of the row above that overlap it or end right next to it.
+        if (y > 0) {
+            int above = rowStarts[y - 1];
+            for (int i = rowStarts[y]; i < static_cast<int>(runs.size()); i++) {
+                while (above < rowStarts[y] && runs[above].x1 < runs[i].x0) {
+                    above++;
+                }
+                for (int j = above; j < rowStarts[y] && runs[j].x0 <= runs[i].x1; j++) {
+                    joinRuns(runs, j, i);
+                }
+            }
+        }
+    }
+    rowStarts[mask.rows()] = static_cast<int>(runs.size());
+
+    // Roots come before the other runs of their blob, so they are initialised before anything is added to them.
+    for (int i = 0; i < static_cast<int>(runs.size()); i++) {
+        MaskRun &run = runs[i];
+        MaskRun &root = runs[findRoot(runs, i)];
+        const int64_t length = run.x1 - run.x0;
+        if (&root == &run) {
+            run.area = 0;
+            run.sumX = 0;
+            run.sumY = 0;
+            run.box = cv::Rect(run.x0, run.y, length, 1);
+        }
+        root.area += length;
+        root.sumX += (static_cast<int64_t>(run.x0) + run.x1 - 1) * length / 2;
+        root.sumY += static_cast<int64_t>(run.y) * length;
+        root.box |= cv::Rect(run.x0, run.y, static_cast<int>(length), 1);
+    }
+
+    // Walking the roots backwards gives the bottom-up order of extractBlobs() on the CV_8UC1 mask.
+    blobs.clear();
+    blobs.reserve(maxBlobs);
+    for (int i = static_cast<int>(runs.size()) - 1; i >= 0 && blobs.size() < maxBlobs; i--) {
+        const MaskRun &run = runs[i];
+        if (run.parent != i || run.area < minArea) {
+            continue;
+        }
+        ConeBlob blob;
+        blob.area = static_cast<int>(run.area);
+        blob.centroid = cv::Point2f(static_cast<float>(static_cast<double>(run.sumX) / run.area + offset.x),
+                                    static_cast<float>(static_cast<double>(run.sumY) / run.area + offset.y));
+        blob.box = run.box + offset;
+        blobs.push_back(blob);
+    }
+}
+
+void refineBlobs(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow, bool blueCones, int step,
+                 cv::Point offset, SegmentationKernel kernel, std::vector<ConeBlob> &blobs,
+                 cv::Mat &blueWindow, cv::Mat &yellowWindow) {
+    const cv::Rect bounds(0, 0, image.cols, image.rows);
+    //The windows are views into buffers of the image size, so a window of a new size does not reallocate
+    blueWindow.create(image.rows, image.cols, CV_8UC1);
+    yellowWindow.create(image.rows, image.cols, CV_8UC1);
+    for (ConeBlob &blob : blobs) {
+        //A sampled pixel stands for the step pixels up to the next sample, so the window gets one sample of margin
+        const cv::Rect window = cv::Rect((blob.box.x - 1) * step, (blob.box.y - 1) * step,
+                                         (blob.box.width + 2) * step, (blob.box.height + 2) * step) & bounds;
+        cv::Mat blueView = blueWindow(cv::Rect(0, 0, window.width, window.height));
+        cv::Mat yellowView = yellowWindow(cv::Rect(0, 0, window.width, window.height));
+        segmentConesFused(image(window), blue, yellow, blueView, yellowView, kernel);
+        const cv::Moments m = cv::moments(blueCones ? blueView : yellowView, true);
+        if (m.m00 > 0) {
+            blob.area = static_cast<int>(m.m00);
+            blob.centroid = cv::Point2f(static_cast<float>(m.m10 / m.m00 + window.x + offset.x),
+                                        static_cast<float>(m.m01 / m.m00 + window.y + offset.y));
+            blob.box = cv::boundingRect(blueCones ? blueView : yellowView) + window.tl() + offset;
+        } else {
+            blob.area *= step * step;
+            blob.centroid = cv::Point2f(blob.centroid.x * step + offset.x, blob.centroid.y * step + offset.y);
+            blob.box = window + offset;
+        }
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONE_SEGMENTATION_HPP
+#define CONE_SEGMENTATION_HPP
+
+#include "packed-mask.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// HSV bounds for one cone colour, in the 8-bit scale used by cvtColor (H: 0..180, S and V: 0..255).
+struct HsvRange {
+    int minHue;
+    int minSat;
+    int minVal;
+    int maxHue;
+    int maxSat;
+    int maxVal;
+};
+
+// Converts one pixel to HSV with the same integer arithmetic as cvtColor(COLOR_BGR2HSV),
+// so the result is bit-identical to what applyFilter() thresholds.
+void bgrToHsv(uint8_t b, uint8_t g, uint8_t r, int &h, int &s, int &v);
+
+// Scalar reference for one row: reads each BGR(A) pixel once and writes 255/0 into both masks.
+void segmentRowScalar(const uint8_t *src, int channels, int width, const HsvRange &blue, const HsvRange &yellow,
+                      uint8_t *blueRow, uint8_t *yellowRow);
+
+// Row kernels the fused segmentation can run. The SIMD kernels need 4-channel (BGRA) input and give
+// bit-identical masks to the scalar reference; 3-channel frames always use the scalar kernel.
+enum class SegmentationKernel { Scalar, Sse41, Avx2 };
+
+// Picks the widest kernel the CPU supports (CPUID); always Scalar on non-x86 targets.
+SegmentationKernel detectSegmentationKernel();
+// Returns false if the kernel is not compiled in or not supported by this CPU.
+bool segmentationKernelSupported(SegmentationKernel kernel);
+const char *segmentationKernelName(SegmentationKernel kernel);
+// Parses "auto", "scalar", "sse4.1" or "avx2" into kernel. Returns false for unknown names and for kernels
+// that segmentationKernelSupported() rejects, so that a test of one kernel never silently runs another.
+bool parseSegmentationKernel(const std::string &name, SegmentationKernel &kernel);
+
+// Fused replacement for calling applyFilter() once per colour: one pass over a CV_8UC3 or CV_8UC4
+// frame produces the blue and the yellow CV_8UC1 mask. The masks are only reallocated when the size changes.
+// If blueColumns is given it is set to the number of blue pixels in every column, counted while each
+// row of the mask is still in L1.
+void segmentConesFused(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                       cv::Mat &blueMask, cv::Mat &yellowMask,
+                       SegmentationKernel kernel = detectSegmentationKernel(), std::vector<int> *blueColumns = nullptr);
+
+// Same classification as segmentConesFused(), written straight into bit-packed masks. Each row is
+// classified in chunks of 64 pixels into a small byte buffer on the stack and packed from there.
+void segmentConesFusedPacked(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                             PackedMask &blueMask, PackedMask &yellowMask,
+                             SegmentationKernel kernel = detectSegmentationKernel(), std::vector<int> *blueColumns = nullptr);
+
+// Coarse pass of --coarse: classifies only every step-th pixel of every step-th row, so the masks are
+// (rows + step - 1) / step by (cols + step - 1) / step. The frame is sampled inside the scalar row kernel
+// instead of being resized first. blueColumns as for segmentConesFused(), in mask columns.
+void segmentConesSampled(const cv::Mat &image, int step, const HsvRange &blue, const HsvRange &yellow,
+                         cv::Mat &blueMask, cv::Mat &yellowMask, std::vector<int> *blueColumns = nullptr);
+
+// Sets columns to the number of non-zero pixels in every column of a CV_8UC1 mask, for masks that were
+// not made by one of the functions above.
+void countColumns(const cv::Mat &mask, std::vector<int> &columns);
+
+// Re-runs the scalar reference on the frame and returns the number of mask bytes that differ from
+// the given masks. Used by --verify-segmentation to check the SIMD kernels on real recordings.
+int countSegmentationMismatches(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow,
+                                const cv::Mat &blueMask, const cv::Mat &yellowMask);
+
+// Colour lookup table for the fused segmentation. The BGR cube is quantised to 64 levels per channel and
+// every cell stores a 2-bit class (none, blue, yellow), so the whole table is 64 KiB and stays in L2.
+// Each cell takes the majority class of the 64 exact colours it covers, which means pixels close to a
+// threshold can be classified differently than by applyFilter(); build() reports how many colours that is.
+class ConeColorLut {
+   public:
+    enum Class : uint8_t { None = 0, Blue = 1, Yellow = 2 };
+
+    ConeColorLut();
+
+    // Rebuilds the table if the bounds differ from the ones it was built for. Returns true if it rebuilt.
+    bool update(const HsvRange &blue, const HsvRange &yellow);
+    // Fraction of all 2^24 BGR colours whose class differs from the exact HSV test, as of the last build.
+    double quantisationError() const;
+
+    uint8_t classify(uint8_t b, uint8_t g, uint8_t r) const {
+        const uint32_t cell = (static_cast<uint32_t>(b >> 2) << 12) | (static_cast<uint32_t>(g >> 2) << 6) | (r >> 2);
+        return static_cast<uint8_t>((m_table[cell >> 2] >> ((cell & 3) * 2)) & 3);
+    }
+
+    // One table lookup per pixel of a CV_8UC3 or CV_8UC4 frame. blueColumns as for segmentConesFused().
+    void segment(const cv::Mat &image, cv::Mat &blueMask, cv::Mat &yellowMask, std::vector<int> *blueColumns = nullptr) const;
+    void segmentPacked(const cv::Mat &image, PackedMask &blueMask, PackedMask &yellowMask,
+                       std::vector<int> *blueColumns = nullptr) const;
+
+   private:
+    void build(const HsvRange &blue, const HsvRange &yellow);
+
+    std::vector<uint8_t> m_table;
+    HsvRange m_blue;
+    HsvRange m_yellow;
+    double m_error;
+};
+
+// How a cone mask is cleaned up before its contours are searched. Canny is the original chain in
+// reduceNoise() (GaussianBlur and Canny, which leaves the outlines of the blobs). Morphology opens and closes
+// the mask with a 3x3 square and Components drops connected components below a minimum area; both keep the
+// blobs filled, which is all moments() needs, and neither does floating-point filtering.
+enum class MaskCleanup { Canny, Morphology, Components };
+
+const char *maskCleanupName(MaskCleanup cleanup);
+// Parses "canny", "morphology" or "components"; unknown names fall back to Canny.
+MaskCleanup parseMaskCleanup(const std::string &name);
+
+// Opening removes specks thinner than 3 px, closing then fills gaps of the same size inside the cones.
+// OpenCV applies the square as separate row and column min/max passes on the 8-bit mask.
+void openCloseMask(const cv::Mat &mask, cv::Mat &opened, cv::Mat &cleaned);
+
+// Horizontal run of set pixels [x0, x1) in row y of a packed mask. parent links the runs of one blob;
+// the sums are only filled in for the first run of each blob.
+struct MaskRun {
+    int y;
+    int x0;
+    int x1;
+    int parent;
+    int64_t area;
+    int64_t sumX;
+    int64_t sumY;
+    cv::Rect box;
+};
+
+// Scratch buffers of removeSmallComponents() and extractBlobs(); kept between frames so that they are not reallocated.
+struct ComponentBuffers {
+    cv::Mat labels;
+    cv::Mat stats;
+    cv::Mat centroids;
+    std::vector<uint8_t> keep;
+    std::vector<MaskRun> runs;
+    std::vector<int> rowStarts;
+};
+
+// Copies the 8-connected components of a CV_8UC1 mask that have at least minArea pixels into cleaned.
+void removeSmallComponents(const cv::Mat &mask, int minArea, ComponentBuffers &buffers, cv::Mat &cleaned);
+
+// One 8-connected blob of a mask, in the coordinates of the full frame.
+struct ConeBlob {
+    int area;
+    cv::Point2f centroid;
+    cv::Rect box;
+};
+
+// Labels the mask once and returns every blob with at least minArea pixels, at most maxBlobs of them, with
+// offset added to the coordinates (for masks of a ROI). The blobs come in the order in which findContours()
+// lists the outer contours, from the bottom of the mask to the top, so blobs[0] is the cone closest to the car;
+// the cap keeps the closest ones. Unlike contour moments the centroid counts every pixel of the blob.
+void extractBlobs(const cv::Mat &mask, int minArea, size_t maxBlobs, cv::Point offset, ComponentBuffers &buffers,
+                  std::vector<ConeBlob> &blobs);
+// The same blobs in the same order from a packed mask. The runs of set bits are found with count-trailing-zeros
+// on whole words and joined row by row, so the mask is never unpacked.
+void extractBlobs(const PackedMask &mask, int minArea, size_t maxBlobs, cv::Point offset, ComponentBuffers &buffers,
+                  std::vector<ConeBlob> &blobs);
+
+// Fine pass of --coarse, and the search of --track between detections (with step 1): blobs found on a mask of
+// segmentConesSampled() are segmented again at full resolution in a window of step px around their box, and the
+// centroid, area and box are replaced by the ones of the blue (blueCones) or yellow pixels in that window, with
+// offset added. The window can also hold pixels of a neighbouring cone of the same colour. Blobs whose window has
+// no such pixel keep their scaled coarse centroid and area and get the window as box. blueWindow and yellowWindow
+// are scratch masks of the image size.
+void refineBlobs(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow, bool blueCones, int step,
+                 cv::Point offset, SegmentationKernel kernel, std::vector<ConeBlob> &blobs,
+                 cv::Mat &blueWindow, cv::Mat &yellowWindow);
+
+#endif
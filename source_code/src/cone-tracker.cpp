@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cone-tracker.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+ConeTracker::ConeTracker(float alpha, float beta, float gate, int margin, int maxMisses)
+    : m_tracks()
+    , m_assigned()
+    , m_alpha(alpha)
+    , m_beta(beta)
+    , m_gate(gate)
+    , m_margin(margin)
+    , m_maxMisses(maxMisses)
+    , m_lost(true) {
+}
+
+void ConeTracker::update(ConeTrack &track, const ConeBlob &blob) {
+    const cv::Point2f residual = blob.centroid - track.position;
+    track.position += m_alpha * residual;
+    track.velocity += m_beta * residual;
+    track.size = blob.box.size();
+    track.misses = 0;
+}
+
+void ConeTracker::removeMissing() {
+    const size_t count = m_tracks.size();
+    m_tracks.erase(std::remove_if(m_tracks.begin(), m_tracks.end(),
+                                  [this](const ConeTrack &track) { return track.misses > m_maxMisses; }),
+                   m_tracks.end());
+    m_lost = m_lost || m_tracks.size() != count || m_tracks.empty();
+}
+
+void ConeTracker::predict(cv::Rect roi, std::vector<ConeBlob> &windows) {
+    windows.clear();
+    for (ConeTrack &track : m_tracks) {
+        track.position += track.velocity;
+        //The window grows with the speed of the cone, so a wrong velocity does not lose it at once
+        const float halfWidth = track.size.width * 0.5f + m_margin + std::fabs(track.velocity.x);
+        const float halfHeight = track.size.height * 0.5f + m_margin + std::fabs(track.velocity.y);
+        const cv::Point topLeft(cvFloor(track.position.x - halfWidth), cvFloor(track.position.y - halfHeight));
+        const cv::Point bottomRight(cvCeil(track.position.x + halfWidth), cvCeil(track.position.y + halfHeight));
+        const cv::Rect window = cv::Rect(topLeft, bottomRight) & roi;
+        if (window.empty()) {
+            track.misses = m_maxMisses + 1;
+            continue;
+        }
+        ConeBlob blob;
+        blob.area = 0;
+        blob.centroid = track.position - cv::Point2f(static_cast<float>(roi.x), static_cast<float>(roi.y));
+        blob.box = window - roi.tl();
+        windows.push_back(blob);
+    }
+    removeMissing();
+}
+
+void ConeTracker::correct(const std::vector<ConeBlob> &blobs) {
+    CV_Assert(blobs.size() == m_tracks.size());
+    for (size_t i = 0; i < m_tracks.size(); i++) {
+        if (blobs[i].area > 0) {
+            update(m_tracks[i], blobs[i]);
+        } else {
+            m_tracks[i].misses++;
+        }
+    }
+    removeMissing();
+}
+
+void ConeTracker::associate(const std::vector<ConeBlob> &blobs) {
+    for (ConeTrack &track : m_tracks) {
+        track.position += track.velocity;
+        track.misses++;
+    }
+    //Greedy, in the order of the blobs: every blob goes to the closest track that has no blob yet.
+    //There are only a few cones per colour, so the quadratic search is cheaper than anything smarter.
+    m_assigned.assign(blobs.size(), -1);
+    for (size_t i = 0; i < blobs.size(); i++) {
+        float closest = m_gate;
+        for (size_t t = 0; t < m_tracks.size(); t++) {
+            const cv::Point2f offset = blobs[i].centroid - m_tracks[t].position;
+            const float distance = std::sqrt(offset.dot(offset));
+            if (distance <= closest && m_tracks[t].misses > 0) {
+                closest = distance;
+                m_assigned[i] = static_cast<int>(t);
+            }
+        }
+        if (m_assigned[i] >= 0) {
+            update(m_tracks[static_cast<size_t>(m_assigned[i])], blobs[i]);
+        }
+    }
+    removeMissing();
+    //Blobs that are close to a track belong to it even if it already had a blob (findContours() returns
+    //an outer and an inner contour for every Canny outline)
+    for (size_t i = 0; i < blobs.size(); i++) {
+        if (m_assigned[i] >= 0) {
+            continue;
+        }
+        bool nearTrack = false;
+        for (const ConeTrack &track : m_tracks) {
+            const cv::Point2f offset = blobs[i].centroid - track.position;
+            nearTrack = nearTrack || (offset.dot(offset) <= m_gate * m_gate);
+        }
+        if (!nearTrack) {
+            m_tracks.push_back(ConeTrack{blobs[i].centroid, cv::Point2f(0.0f, 0.0f), blobs[i].box.size(), 0});
+        }
+    }
+    //Tracks that were dropped here do not need another detection, only an empty tracker does
+    m_lost = m_tracks.empty();
+}
+
+void ConeTracker::output(std::vector<ConeBlob> &blobs) const {
+    blobs.clear();
+    for (const ConeTrack &track : m_tracks) {
+        if (track.misses > 0) {
+            continue;
+        }
+        ConeBlob blob;
+        blob.area = track.size.area();
+        blob.centroid = track.position;
+        blob.box = cv::Rect(cvRound(track.position.x - track.size.width * 0.5f), cvRound(track.position.y - track.size.height * 0.5f),
+                            track.size.width, track.size.height);
+        blobs.push_back(blob);
+    }
+    std::sort(blobs.begin(), blobs.end(), [](const ConeBlob &a, const ConeBlob &b) { return a.centroid.y > b.centroid.y; });
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONE_TRACKER_HPP
+#define CONE_TRACKER_HPP
+
+#include "cone-segmentation.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+// One cone followed from frame to frame, in frame coordinates. The velocity is in px per frame.
+struct ConeTrack {
+    cv::Point2f position;
+    cv::Point2f velocity;
+    cv::Size size;  //box of the last blob that was assigned to the track
+    int misses;     //frames in a row without a blob
+};
+
+// Alpha-beta filter (constant velocity) for the cones of one colour. On detection frames the blobs of the whole
+// ROI are assigned to the tracks; on the frames in between every track is only searched for in a window around
+// its predicted position. The tracks are kept in a vector that is reused, so tracking does not allocate after
+// the first frames.
+class ConeTracker {
+   public:
+    // alpha and beta weigh the position and the velocity correction, gate is the largest distance in px between
+    // a prediction and the blob assigned to it, margin is added around the predicted box on every side, and
+    // a track is dropped after more than maxMisses frames without a blob.
+    ConeTracker(float alpha, float beta, float gate, int margin, int maxMisses);
+
+    // Moves every track one frame ahead and sets windows to one blob per track, with area 0, the prediction as
+    // centroid and the search window as box, both relative to roi. Tracks whose window is outside roi are dropped.
+    void predict(cv::Rect roi, std::vector<ConeBlob> &windows);
+    // Corrects track i with blob i of the windows after refineBlobs(); a blob with area 0 counts as a miss.
+    void correct(const std::vector<ConeBlob> &blobs);
+    // Detection frame: moves the tracks ahead, assigns every blob (frame coordinates) to the closest prediction
+    // within the gate and starts a track for every blob that is not within the gate of any track.
+    void associate(const std::vector<ConeBlob> &blobs);
+    // Filtered positions of the tracks that have been seen in the last frame, from the bottom of the frame to
+    // the top like extractBlobs().
+    void output(std::vector<ConeBlob> &blobs) const;
+
+    // True if a track was dropped or there is none; cleared by associate() when it leaves at least one track.
+    bool lost() const {
+        return m_lost;
+    }
+
+   private:
+    void update(ConeTrack &track, const ConeBlob &blob);
+    void removeMissing();
+
+    std::vector<ConeTrack> m_tracks;
+    std::vector<int> m_assigned;  //track of every blob in associate(), or -1
+    float m_alpha;
+    float m_beta;
+    float m_gate;
+    int m_margin;
+    int m_maxMisses;
+    bool m_lost;
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "frame-pipeline.hpp"
+
+#include "allocation-counter.hpp"
+
+BranchWorker::BranchWorker()
+    : m_mutex()
+    , m_wakeUp()
+    , m_done()
+    , m_call(nullptr)
+    , m_task(nullptr)
+    , m_pending(false)
+    , m_stop(false)
+    , m_allocations(0)
+    , m_error()
+    , m_thread(&BranchWorker::loop, this) {}
+
+BranchWorker::~BranchWorker() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeUp.notify_one();
+    m_thread.join();
+}
+
+void BranchWorker::start(void (*call)(const void *, int), const void *task) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_call = call;
+        m_task = task;
+        m_pending = true;
+    }
+    m_wakeUp.notify_one();
+}
+
+void BranchWorker::finish() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return !m_pending; });
+    if (m_error) {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void BranchWorker::loop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wakeUp.wait(lock, [this] { return m_pending || m_stop; });
+        if (m_stop) {
+            return;
+        }
+        lock.unlock();
+        const uint64_t before = allocationCount();
+        std::exception_ptr error;
+        try {
+            m_call(m_task, 1);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        const uint64_t allocations = allocationCount() - before;
+        lock.lock();
+        m_allocations = allocations;
+        m_error = error;
+        m_pending = false;
+        m_done.notify_one();
+    }
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FRAME_PIPELINE_HPP
+#define FRAME_PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+// Bounded lock-free queue between two pipeline stages. Exactly one thread may call push() and exactly
+// one other thread may call pop()/waitPop(); the storage is fixed, so neither side allocates.
+// CAPACITY must be a power of two.
+template <typename T, size_t CAPACITY>
+class SpscQueue {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+   public:
+    SpscQueue()
+        : m_items()
+        , m_head(0)
+        , m_tail(0)
+        , m_maxDepth(0)
+        , m_drops(0) {}
+
+    // Returns false and counts a drop if the queue is full.
+    bool push(const T &value) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        if (head - tail == CAPACITY) {
+            recordDrop();
+            return false;
+        }
+        m_items[head & (CAPACITY - 1)] = value;
+        m_head.store(head + 1, std::memory_order_release);
+        if (head + 1 - tail > m_maxDepth.load(std::memory_order_relaxed)) {
+            m_maxDepth.store(head + 1 - tail, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool pop(T &value) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+        value = m_items[tail & (CAPACITY - 1)];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Spins, then sleeps in short steps until an item arrives. Returns false once running is cleared.
+    bool waitPop(T &value, const std::atomic<bool> &running) {
+        for (int spins = 0; running.load(std::memory_order_relaxed); spins++) {
+            if (pop(value)) {
+                return true;
+            }
+            if (spins < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        return false;
+    }
+
+    // Counts an item that the producer gave up on before calling push(), e.g. because it had no buffer for it.
+    void recordDrop() {
+        m_drops.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The counters may be read from any thread; depth() is a snapshot.
+    size_t depth() const {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+    size_t maxDepth() const {
+        return m_maxDepth.load(std::memory_order_relaxed);
+    }
+    uint64_t drops() const {
+        return m_drops.load(std::memory_order_relaxed);
+    }
+
+   private:
+    T m_items[CAPACITY];
+    // Producer and consumer indices on separate cache lines so that the two threads do not share one.
+    alignas(64) std::atomic<size_t> m_head;
+    alignas(64) std::atomic<size_t> m_tail;
+    alignas(64) std::atomic<size_t> m_maxDepth;
+    std::atomic<uint64_t> m_drops;
+};
+
+// Hands the newest value from one producer thread to one consumer thread (triple buffering). Neither side
+// ever waits: the producer fills back() and publish()es it, overwriting a value the consumer has not taken
+// yet, and the consumer swaps the newest value into front() with update().
+template <typename T>
+class LatestValue {
+   public:
+    LatestValue()
+        : m_slots()
+        , m_back(0)
+        , m_front(1)
+        , m_middle(2) {}
+
+    // Every slot, e.g. to preallocate them before the threads start.
+    T &slot(int index) {
+        return m_slots[index];
+    }
+
+    T &back() {
+        return m_slots[m_back];
+    }
+
+    void publish() {
+        m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    // Returns false if nothing has been published since the last update().
+    bool update() {
+        if ((m_middle.load(std::memory_order_relaxed) & FRESH) == 0) {
+            return false;
+        }
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    T &front() {
+        return m_slots[m_front];
+    }
+
+   private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;  // set in m_middle while it holds a value the consumer has not seen
+    T m_slots[3];
+    int m_back;   // producer only
+    int m_front;  // consumer only
+    std::atomic<int> m_middle;
+};
+
+// Persistent helper thread for the two independent halves of a frame (the blue and the yellow cones).
+// runPair(task) runs task(1) on the helper and task(0) on the calling thread and returns when both are done.
+// The task is passed by pointer, so handing it over does not allocate. Only one thread may call runPair().
+class BranchWorker {
+   public:
+    BranchWorker();
+    ~BranchWorker();
+    BranchWorker(const BranchWorker &) = delete;
+    BranchWorker &operator=(const BranchWorker &) = delete;
+
+    template <typename Task>
+    void runPair(const Task &task) {
+        start(&invoke<Task>, &task);
+        try {
+            task(0);
+        } catch (...) {
+            finish();
+            throw;
+        }
+        finish();
+    }
+
+    // Heap allocations the helper made during the last runPair(); the counter of the caller does not see them.
+    uint64_t lastAllocations() const {
+        return m_allocations;
+    }
+
+   private:
+    template <typename Task>
+    static void invoke(const void *task, int index) {
+        (*static_cast<const Task *>(task))(index);
+    }
+
+    void start(void (*call)(const void *, int), const void *task);
+    // Waits for the helper and rethrows an exception that its half of the task has thrown.
+    void finish();
+    void loop();
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::condition_variable m_done;
+    void (*m_call)(const void *, int);
+    const void *m_task;
+    bool m_pending;
+    bool m_stop;
+    uint64_t m_allocations;
+    std::exception_ptr m_error;
+    std::thread m_thread;
+};
+
+#endif
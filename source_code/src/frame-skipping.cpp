@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frame-skipping.hpp"
+
+#include <cstdlib>
+
+FrameChangeDetector::FrameChangeDetector(int step, double threshold)
+    : m_reference()
+    , m_samples()
+    , m_roi()
+    , m_step(step)
+    , m_threshold(threshold)
+    , m_difference(0.0)
+    , m_valid(false) {
+}
+
+bool FrameChangeDetector::changed(const cv::Mat &image, cv::Rect roi) {
+    CV_Assert(image.depth() == CV_8U && image.channels() >= 3);
+    const int channels = image.channels();
+    m_samples.clear();
+    for (int y = roi.y; y < roi.y + roi.height; y += m_step) {
+        const uint8_t *pixel = image.ptr<uint8_t>(y) + roi.x * channels;
+        for (int x = 0; x < roi.width; x += m_step, pixel += m_step * channels) {
+            m_samples.push_back(pixel[0]);
+            m_samples.push_back(pixel[1]);
+            m_samples.push_back(pixel[2]);
+        }
+    }
+
+    bool differs = !m_valid || roi != m_roi || m_samples.empty();
+    if (!differs) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < m_samples.size(); i++) {
+            sum += static_cast<uint64_t>(std::abs(m_samples[i] - m_reference[i]));
+        }
+        m_difference = static_cast<double>(sum) / static_cast<double>(m_samples.size());
+        differs = m_difference > m_threshold;
+    }
+    if (differs) {
+        m_reference.swap(m_samples);
+        m_roi = roi;
+        m_valid = true;
+    }
+    return differs;
+}
+
+ProducerGapCounter::ProducerGapCounter()
+    : m_last(0)
+    , m_period(0)
+    , m_valid(false) {
+}
+
+uint64_t ProducerGapCounter::add(int64_t microseconds) {
+    const int64_t gap = microseconds - m_last;
+    const bool valid = m_valid;
+    m_last = microseconds;
+    m_valid = true;
+    //A replay that starts over goes back in time
+    if (!valid || gap <= 0) {
+        return 0;
+    }
+    if (m_period == 0 || gap < m_period) {
+        m_period = gap;
+    }
+    const int64_t frames = (gap + m_period / 2) / m_period;
+    return (frames > 1) ? static_cast<uint64_t>(frames - 1) : 0;
+}
+
+PipelineBacklog::PipelineBacklog(size_t capacity)
+    : m_capacity(capacity)
+    , m_entered(new std::atomic<int64_t>[capacity])
+    , m_enteredFrames(0)
+    , m_leftFrames(0) {
+}
+
+void PipelineBacklog::enter(int64_t microseconds) {
+    const uint64_t frame = m_enteredFrames.load(std::memory_order_relaxed);
+    m_entered[frame % m_capacity].store(microseconds, std::memory_order_relaxed);
+    m_enteredFrames.store(frame + 1, std::memory_order_release);
+}
+
+void PipelineBacklog::leave() {
+    m_leftFrames.fetch_add(1, std::memory_order_release);
+}
+
+bool PipelineBacklog::behind(int64_t now, int64_t period) const {
+    const uint64_t oldest = m_leftFrames.load(std::memory_order_acquire);
+    if (period == 0 || oldest == m_enteredFrames.load(std::memory_order_acquire)) {
+        return false;
+    }
+    return now - m_entered[oldest % m_capacity].load(std::memory_order_relaxed) > period;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_SKIPPING_HPP
+#define FRAME_SKIPPING_HPP
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Cheap test whether a frame is worth processing. Every step-th pixel of every step-th row of the ROI is compared
+// with the same pixel of the last frame that was reported as changed, so a slow drift adds up until it counts.
+// A frame is unchanged if the mean absolute difference of the sampled B, G and R values is at most threshold.
+class FrameChangeDetector {
+   public:
+    FrameChangeDetector(int step, double threshold);
+
+    // True for the first frame, a frame with another ROI and a frame that differs from the reference; the frame
+    // then becomes the new reference. Only reallocates when the ROI grows.
+    bool changed(const cv::Mat &image, cv::Rect roi);
+    // Mean absolute difference found by the last call.
+    double lastDifference() const {
+        return m_difference;
+    }
+
+   private:
+    std::vector<uint8_t> m_reference;
+    std::vector<uint8_t> m_samples;
+    cv::Rect m_roi;
+    int m_step;
+    double m_threshold;
+    double m_difference;
+    bool m_valid;
+};
+
+// Estimates how many frames the producer wrote between two acquired frames from the time stamps it puts into the
+// shared memory. The frame period of the producer is taken as the smallest gap between two acquired frames so far,
+// so the first gaps can be undercounted until two consecutive frames have been acquired.
+class ProducerGapCounter {
+   public:
+    ProducerGapCounter();
+
+    // Returns the number of frames that were missed before the frame with this time stamp.
+    uint64_t add(int64_t microseconds);
+    // Frame period of the producer in us, 0 until two frames have been added.
+    int64_t period() const {
+        return m_period;
+    }
+
+   private:
+    int64_t m_last;
+    int64_t m_period;
+    bool m_valid;
+};
+
+// Frames in a pipeline whose stages keep their order, for --skip-behind: a new frame is dropped while the oldest frame
+// in the pipeline has been in it for longer than one frame period of the producer (see ProducerGapCounter), since
+// the producer has then already written a newer frame than the one the steering is working on. At most capacity
+// frames may be in the pipeline. enter() is called by the thread that feeds the pipeline, leave() by the thread
+// at its end before the buffers of the frame are reused.
+class PipelineBacklog {
+   public:
+    explicit PipelineBacklog(size_t capacity);
+    PipelineBacklog(const PipelineBacklog &) = delete;
+    PipelineBacklog &operator=(const PipelineBacklog &) = delete;
+
+    void enter(int64_t microseconds);
+    void leave();
+    // False while the pipeline is empty or the period is not known yet (0).
+    bool behind(int64_t now, int64_t period) const;
+
+   private:
+    const size_t m_capacity;
+    std::unique_ptr<std::atomic<int64_t>[]> m_entered;
+    std::atomic<uint64_t> m_enteredFrames;
+    std::atomic<uint64_t> m_leftFrames;
+};
+
+#endif
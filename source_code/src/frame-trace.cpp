@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "frame-trace.hpp"
+#include "thread-registry.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace {
+
+// How often the writer thread looks for a request; a signal is at most this late
+const std::chrono::milliseconds WRITE_POLL_INTERVAL(100);
+
+// Written with relaxed stores by the thread that owns the ring. An event that is being overwritten while
+// writeTrace() copies it is dropped by its index.
+struct TraceEvent {
+    std::atomic<const char *> name;
+    std::atomic<int64_t> frame;
+    std::atomic<int64_t> begin;  //ns since startTracing()
+    std::atomic<int64_t> end;
+};
+
+struct TraceRing {
+    TraceRing(const char *threadName, int threadId, size_t size)
+        : thread(threadName)
+        , id(threadId)
+        , capacity(size)
+        , events(new TraceEvent[size])
+        , written(0) {}
+    TraceRing(const TraceRing &) = delete;
+    TraceRing &operator=(const TraceRing &) = delete;
+
+    const char *thread;
+    int id;
+    size_t capacity;
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<uint64_t> written;  //events recorded so far; the next one goes to written % capacity
+};
+
+// A copy of one event taken by writeTrace()
+struct CopiedEvent {
+    uint64_t index;
+    const char *name;
+    int64_t frame;
+    int64_t begin;
+    int64_t end;
+};
+
+std::atomic<bool> enabled{false};
+size_t ringCapacity = 0;
+std::chrono::steady_clock::time_point origin;
+ThreadRegistry<TraceRing> registry;
+
+int64_t nanosecondsSinceOrigin() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+TraceRing &ring(const char *name) {
+    return registry.own([name](size_t index) {
+        return new TraceRing(name, static_cast<int>(index) + 1, ringCapacity);
+    });
+}
+
+// Event times are written in us, the unit of the format
+void writeMicroseconds(std::ostream &out, int64_t nanoseconds) {
+    out << nanoseconds / 1000 << "." << static_cast<char>('0' + (nanoseconds / 100) % 10)
+        << static_cast<char>('0' + (nanoseconds / 10) % 10) << static_cast<char>('0' + nanoseconds % 10);
+}
+
+}  // namespace
+
+void startTracing(size_t eventsPerThread) {
+    ringCapacity = (eventsPerThread > 0) ? eventsPerThread : 1;
+    origin = std::chrono::steady_clock::now();
+    enabled.store(true, std::memory_order_release);
+}
+
+bool tracingEnabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void nameTraceThread(const char *name) {
+    if (tracingEnabled()) {
+        ring(name);
+    }
+}
+
+TraceScope::TraceScope(const char *name, int64_t frame)
+    : m_name(name)
+    , m_frame(frame)
+    , m_begin(0)
+    , m_enabled(tracingEnabled()) {
+    if (m_enabled) {
+        m_begin = nanosecondsSinceOrigin();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (!m_enabled) {
+        return;
+    }
+    const int64_t end = nanosecondsSinceOrigin();
+    TraceRing &own = ring("thread");
+    const uint64_t index = own.written.load(std::memory_order_relaxed);
+    TraceEvent &event = own.events[index % own.capacity];
+    event.name.store(m_name, std::memory_order_relaxed);
+    event.frame.store(m_frame, std::memory_order_relaxed);
+    event.begin.store(m_begin, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    own.written.store(index + 1, std::memory_order_release);
+}
+
+bool writeTrace(const std::string &path) {
+    std::ofstream out(path.c_str());
+    if (!out) {
+        return false;
+    }
+    const long pid = static_cast<long>(::getpid());
+    std::vector<CopiedEvent> copied;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    registry.forEach([&](const TraceRing &thread) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread.id
+            << ",\"args\":{\"name\":\"" << thread.thread << "\"}}";
+        first = false;
+
+        const uint64_t written = thread.written.load(std::memory_order_acquire);
+        const uint64_t oldest = (written > thread.capacity) ? written - thread.capacity : 0;
+        copied.clear();
+        for (uint64_t index = oldest; index < written; index++) {
+            const TraceEvent &event = thread.events[index % thread.capacity];
+            copied.push_back(CopiedEvent{index, event.name.load(std::memory_order_relaxed), event.frame.load(std::memory_order_relaxed),
+                                         event.begin.load(std::memory_order_relaxed), event.end.load(std::memory_order_relaxed)});
+        }
+        //The slot of the event after the last one that was written may already be in use
+        const uint64_t now = thread.written.load(std::memory_order_acquire);
+        const uint64_t valid = (now + 1 > thread.capacity) ? now + 1 - thread.capacity : 0;
+        for (const CopiedEvent &event : copied) {
+            if (event.index < valid) {
+                continue;
+            }
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << thread.id << ",\"ts\":";
+            writeMicroseconds(out, event.begin);
+            out << ",\"dur\":";
+            writeMicroseconds(out, event.end - event.begin);
+            if (event.frame >= 0) {
+                out << ",\"args\":{\"frame\":" << event.frame << "}";
+            }
+            out << "}";
+        }
+    });
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+void installTraceWriteSignal() {
+    PolledSignal<SIGUSR2>::install();
+}
+
+bool traceWriteRequested() {
+    return PolledSignal<SIGUSR2>::requested();
+}
+
+TraceWriter::TraceWriter(const std::string &path, const std::string &program)
+    : m_path(path)
+    , m_program(program)
+    , m_mutex()
+    , m_stopped()
+    , m_running(true)
+    , m_thread() {
+    m_thread = std::thread(&TraceWriter::run, this);
+}
+
+TraceWriter::~TraceWriter() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_stopped.notify_one();
+    m_thread.join();
+}
+
+void TraceWriter::run() {
+    //Only runs when no other thread of the process wants the CPU; failing to lower the priority is not an error
+    sched_param idle{};
+    idle.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &idle);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopped.wait_for(lock, WRITE_POLL_INTERVAL, [this]() { return !m_running; })) {
+        if (traceWriteRequested() && !writeTrace(m_path)) {
+            std::clog << m_program << ": Could not write the trace into " << m_path << "." << std::endl;
+        }
+    }
+}
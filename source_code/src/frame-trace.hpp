@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FRAME_TRACE_HPP
+#define FRAME_TRACE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Timeline of the frame loop in the Chrome Trace Event format, for chrome://tracing or ui.perfetto.dev.
+// Every thread writes the events of its TraceScopes into a ring buffer of its own that is allocated when the thread
+// records its first event or calls nameTraceThread(); after that recording neither allocates nor locks. When the
+// ring is full the oldest events are overwritten, so the file holds the last eventsPerThread events of every thread.
+// Until startTracing() is called a TraceScope only tests a flag.
+
+// Turns tracing on; only call it once, before the threads that are traced are started.
+void startTracing(size_t eventsPerThread);
+bool tracingEnabled();
+// Names the calling thread in the timeline. Does nothing when tracing is off or the thread already has a ring,
+// so it can be called from callbacks that run on a thread that is not ours.
+void nameTraceThread(const char *name);
+
+// Records the time from its construction to its destruction as one event. The name has to outlive the
+// tracing, a string literal is the usual choice. frame is shown as an argument of the event if it is not negative.
+class TraceScope {
+   public:
+    explicit TraceScope(const char *name, int64_t frame = -1);
+    ~TraceScope();
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+   private:
+    const char *m_name;
+    int64_t m_frame;
+    int64_t m_begin;
+    bool m_enabled;
+};
+
+// Writes the events of all threads into a JSON file; returns false if the file cannot be written. It can be called
+// while the threads keep recording, events that are overwritten during the copy are left out.
+bool writeTrace(const std::string &path);
+// Makes SIGUSR2 request a trace file, which traceWriteRequested() returns once (see PolledSignal).
+void installTraceWriteSignal();
+bool traceWriteRequested();
+
+// Polls traceWriteRequested() on a thread of its own at idle priority and writes the trace into path when it
+// returns true, so that copying the rings and writing the file never delay a frame. program prefixes the error
+// message when the file cannot be written. The destructor stops and joins the thread.
+class TraceWriter {
+   public:
+    TraceWriter(const std::string &path, const std::string &program);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+   private:
+    void run();
+
+    const std::string m_path;
+    const std::string m_program;
+    std::mutex m_mutex;
+    std::condition_variable m_stopped;
+    bool m_running;
+    std::thread m_thread;
+};
+
+#endif
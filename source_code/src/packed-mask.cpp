@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "packed-mask.hpp"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define PACKED_MASK_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const uint64_t ALL_SET = ~static_cast<uint64_t>(0);
+
+// One word of a row after a horizontal 3-pixel AND (erode) or OR (dilate). outside is what the pixels left
+// and right of the row count as; padding holds the bits past the end of the row in this word.
+template <bool ERODE>
+inline uint64_t horizontal(const uint64_t *row, int i, int words, uint64_t lastMask) {
+    const uint64_t outside = ERODE ? ALL_SET : 0;
+    const uint64_t padding = ERODE ? ~lastMask : 0;
+    const uint64_t word = row[i] | (i == words - 1 ? padding : 0);
+    const uint64_t previous = (i > 0) ? row[i - 1] : outside;
+    const uint64_t next = (i + 1 < words) ? (row[i + 1] | (i + 1 == words - 1 ? padding : 0)) : outside;
+    const uint64_t left = (word << 1) | (previous >> 63);
+    const uint64_t right = (word >> 1) | (next << 63);
+    return ERODE ? (word & left & right) : (word | left | right);
+}
+
+template <bool ERODE>
+void morphologyPacked(const PackedMask &src, PackedMask &dst) {
+    CV_Assert(&src != &dst);
+    dst.create(src.rows(), src.cols());
+    const int words = src.wordsPerRow();
+    if (words == 0) {
+        return;
+    }
+    const uint64_t lastMask = src.lastWordMask();
+    for (int y = 0; y < src.rows(); y++) {
+        const uint64_t *above = (y > 0) ? src.row(y - 1) : nullptr;
+        const uint64_t *centre = src.row(y);
+        const uint64_t *below = (y + 1 < src.rows()) ? src.row(y + 1) : nullptr;
+        uint64_t *out = dst.row(y);
+        for (int i = 0; i < words; i++) {
+            uint64_t word = horizontal<ERODE>(centre, i, words, lastMask);
+            // Rows outside the mask are left out, which is the same as all set (erode) or all clear (dilate).
+            if (above != nullptr) {
+                const uint64_t h = horizontal<ERODE>(above, i, words, lastMask);
+                word = ERODE ? (word & h) : (word | h);
+            }
+            if (below != nullptr) {
+                const uint64_t h = horizontal<ERODE>(below, i, words, lastMask);
+                word = ERODE ? (word & h) : (word | h);
+            }
+            out[i] = word;
+        }
+        out[words - 1] &= lastMask;
+    }
+}
+
+}  // namespace
+
+PackedMask::PackedMask()
+    : m_words()
+    , m_rows(0)
+    , m_cols(0)
+    , m_wordsPerRow(0) {}
+
+void PackedMask::create(int rows, int cols) {
+    m_rows = rows;
+    m_cols = cols;
+    m_wordsPerRow = (cols + 63) / 64;
+    m_words.resize(static_cast<size_t>(rows) * m_wordsPerRow);
+}
+
+uint64_t PackedMask::lastWordMask() const {
+    const int bits = m_cols % 64;
+    return bits == 0 ? ALL_SET : ((static_cast<uint64_t>(1) << bits) - 1);
+}
+
+void PackedMask::pack(const cv::Mat &mask) {
+    CV_Assert(mask.type() == CV_8UC1);
+    create(mask.rows, mask.cols);
+    for (int y = 0; y < mask.rows; y++) {
+        packRow(mask.ptr<uint8_t>(y), mask.cols, row(y));
+    }
+}
+
+void PackedMask::unpack(cv::Mat &mask) const {
+    mask.create(m_rows, m_cols, CV_8UC1);
+    for (int y = 0; y < m_rows; y++) {
+        const uint64_t *words = row(y);
+        uint8_t *dst = mask.ptr<uint8_t>(y);
+        for (int x = 0; x < m_cols; x++) {
+            dst[x] = ((words[x >> 6] >> (x & 63)) & 1) ? 255 : 0;
+        }
+    }
+}
+
+void packRow(const uint8_t *src, int width, uint64_t *dst) {
+    for (int i = 0; i * 64 < width; i++) {
+        const int begin = i * 64;
+        const int end = (begin + 64 < width) ? begin + 64 : width;
+        uint64_t word = 0;
+        int x = begin;
+#ifdef PACKED_MASK_SSE2
+        // 16 pixels per compare; movemask gathers the top bit of every byte.
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= end; x += 16) {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+            const uint64_t isZero = static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)));
+            word |= (~isZero & 0xFFFF) << (x - begin);
+        }
+#endif
+        for (; x < end; x++) {
+            word |= static_cast<uint64_t>(src[x] != 0) << (x - begin);
+        }
+        dst[i] = word;
+    }
+}
+
+void erodePacked(const PackedMask &src, PackedMask &dst) {
+    morphologyPacked<true>(src, dst);
+}
+
+void dilatePacked(const PackedMask &src, PackedMask &dst) {
+    morphologyPacked<false>(src, dst);
+}
+
+void openClosePacked(const PackedMask &mask, PackedMask &scratch, PackedMask &cleaned) {
+    erodePacked(mask, scratch);
+    dilatePacked(scratch, cleaned);  // opened
+    dilatePacked(cleaned, scratch);
+    erodePacked(scratch, cleaned);   // closed
+}
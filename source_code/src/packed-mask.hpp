@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PACKED_MASK_HPP
+#define PACKED_MASK_HPP
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Binary mask with one bit per pixel. Every row starts at a new 64-bit word; pixel x of a row is bit x % 64
+// of word x / 64, and the bits past cols() in the last word of a row are always zero.
+// A 640x480 mask takes 38 KiB instead of 300 KiB as CV_8UC1.
+class PackedMask {
+   public:
+    PackedMask();
+
+    // Keeps the storage if the size does not change; the contents are undefined afterwards.
+    void create(int rows, int cols);
+
+    int rows() const {
+        return m_rows;
+    }
+    int cols() const {
+        return m_cols;
+    }
+    int wordsPerRow() const {
+        return m_wordsPerRow;
+    }
+    uint64_t *row(int y) {
+        return &m_words[static_cast<size_t>(y) * m_wordsPerRow];
+    }
+    const uint64_t *row(int y) const {
+        return &m_words[static_cast<size_t>(y) * m_wordsPerRow];
+    }
+    // Valid bits of the last word of a row.
+    uint64_t lastWordMask() const;
+
+    // Sets a bit for every non-zero pixel of a CV_8UC1 mask.
+    void pack(const cv::Mat &mask);
+    // Writes the mask back as a CV_8UC1 image of 0 and 255.
+    void unpack(cv::Mat &mask) const;
+
+   private:
+    std::vector<uint64_t> m_words;
+    int m_rows;
+    int m_cols;
+    int m_wordsPerRow;
+};
+
+// Packs width bytes (zero or not) into (width + 63) / 64 words; the bits past width are cleared.
+void packRow(const uint8_t *src, int width, uint64_t *dst);
+
+// Erosion and dilation with a 3x3 square, on whole words. The borders behave like cv::erode and cv::dilate:
+// pixels outside the mask never erode or dilate their neighbours. src and dst must not be the same mask.
+void erodePacked(const PackedMask &src, PackedMask &dst);
+void dilatePacked(const PackedMask &src, PackedMask &dst);
+
+// Same result as openCloseMask() on the unpacked mask; scratch is overwritten.
+void openClosePacked(const PackedMask &mask, PackedMask &scratch, PackedMask &cleaned);
+
+#endif
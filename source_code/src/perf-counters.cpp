@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "perf-counters.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+enum Counter { Cycles, Instructions, CacheMisses, Branches, BranchMisses, COUNTERS };
+const int STAGES = static_cast<int>(CounterStage::Count);
+// m_before of StageCounters holds the time enabled and running and then the counters
+const int TIME_ENABLED = 0;
+const int TIME_RUNNING = 1;
+const int VALUES = 2;
+static_assert(VALUES + COUNTERS <= 8, "StageCounters::m_before is too small");
+
+const char *stageName(int stage) {
+    switch (static_cast<CounterStage>(stage)) {
+        case CounterStage::Acquire:
+            return "acquire";
+        case CounterStage::Segment:
+            return "segment";
+        case CounterStage::Geometry:
+            return "geometry";
+        case CounterStage::Control:
+            return "control";
+        default:
+            return "unknown";
+    }
+}
+
+// Sums over all frames; a stage only runs on one thread at a time, the atomics are for the concurrent printing
+struct StageTotals {
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> unscheduled;  //frames in which the kernel did not count the group at all
+    std::atomic<uint64_t> values[COUNTERS];
+};
+
+std::atomic<bool> enabled{false};
+std::atomic<unsigned> measuredCounters{0};  //bit per Counter that some thread could open
+StageTotals totals[STAGES];
+
+// The counter group of one thread. slots[counter] is the position of the counter in what read() returns, -1 if it
+// could not be opened.
+struct CounterGroup {
+    bool opened{false};
+    int leader{-1};
+    int count{0};
+    int fds[COUNTERS];
+    int slots[COUNTERS];
+};
+thread_local CounterGroup group;
+
+#ifdef __linux__
+int openCounter(uint64_t config, int leader) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = (leader == -1) ? 1 : 0;
+    //User space only, which perf_event_paranoid=2 still allows unprivileged
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0));
+}
+
+// Opens the group of the calling thread once; returns 0 or the errno of the cycle counter
+int openGroup() {
+    if (group.opened) {
+        return (group.leader == -1) ? ENODEV : 0;
+    }
+    group.opened = true;
+    const uint64_t configs[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+                                        PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int counter = 0; counter < COUNTERS; counter++) {
+        group.slots[counter] = -1;
+        group.fds[counter] = openCounter(configs[counter], group.leader);
+        if (group.fds[counter] == -1) {
+            if (counter == Cycles) {
+                return errno;
+            }
+            continue;
+        }
+        if (counter == Cycles) {
+            group.leader = group.fds[counter];
+        }
+        group.slots[counter] = group.count++;
+        measuredCounters.fetch_or(1u << counter, std::memory_order_relaxed);
+    }
+    ::ioctl(group.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ::ioctl(group.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+// values gets the time enabled, the time running and then every counter in Counter order (0 if not opened)
+bool readGroup(uint64_t *values) {
+    uint64_t buffer[3 + COUNTERS];
+    const ssize_t expected = static_cast<ssize_t>((3 + group.count) * sizeof(uint64_t));
+    if (::read(group.leader, buffer, sizeof(buffer)) != expected) {
+        return false;
+    }
+    values[TIME_ENABLED] = buffer[1];
+    values[TIME_RUNNING] = buffer[2];
+    for (int counter = 0; counter < COUNTERS; counter++) {
+        values[VALUES + counter] = (group.slots[counter] == -1) ? 0 : buffer[3 + group.slots[counter]];
+    }
+    return true;
+}
+#else
+int openGroup() {
+    return ENOSYS;
+}
+
+bool readGroup(uint64_t *) {
+    return false;
+}
+#endif
+
+void add(std::atomic<uint64_t> &total, uint64_t value) {
+    total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+bool startPerfCounters(std::string &error) {
+    const int result = openGroup();
+    if (result != 0) {
+        error = std::strerror(result);
+        return false;
+    }
+    enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+StageCounters::StageCounters(CounterStage stage)
+    : m_stage(stage)
+    , m_valid(false) {
+    if (enabled.load(std::memory_order_relaxed) && openGroup() == 0) {
+        m_valid = readGroup(m_before);
+    }
+}
+
+StageCounters::~StageCounters() {
+    uint64_t after[VALUES + COUNTERS];
+    if (!m_valid || !readGroup(after)) {
+        return;
+    }
+    StageTotals &stage = totals[static_cast<int>(m_stage)];
+    add(stage.frames, 1);
+    const uint64_t enabledTime = after[TIME_ENABLED] - m_before[TIME_ENABLED];
+    const uint64_t runningTime = after[TIME_RUNNING] - m_before[TIME_RUNNING];
+    if (runningTime == 0) {
+        add(stage.unscheduled, 1);
+        return;
+    }
+    const double scale = static_cast<double>(enabledTime) / static_cast<double>(runningTime);
+    for (int counter = 0; counter < COUNTERS; counter++) {
+        const uint64_t delta = after[VALUES + counter] - m_before[VALUES + counter];
+        add(stage.values[counter], (runningTime < enabledTime) ? static_cast<uint64_t>(static_cast<double>(delta) * scale) : delta);
+    }
+}
+
+void printPerfCounters(std::ostream &out) {
+    const unsigned measured = measuredCounters.load(std::memory_order_relaxed);
+    auto has = [measured](int counter) { return (measured & (1u << counter)) != 0; };
+    out << "hardware counters per frame (frames cycles instructions IPC cache-misses MPKI branch-misses branch-miss-%, - if not available):" << std::endl;
+    for (int index = 0; index < STAGES; index++) {
+        const StageTotals &stage = totals[index];
+        const uint64_t frames = stage.frames.load(std::memory_order_relaxed);
+        if (frames == 0) {
+            continue;
+        }
+        const double counted = static_cast<double>(frames - stage.unscheduled.load(std::memory_order_relaxed));
+        double perFrame[COUNTERS];
+        for (int counter = 0; counter < COUNTERS; counter++) {
+            perFrame[counter] = (counted > 0.0) ? static_cast<double>(stage.values[counter].load(std::memory_order_relaxed)) / counted : 0.0;
+        }
+        auto print = [&](bool available, double value) {
+            if (available) {
+                out << " " << value;
+            } else {
+                out << " -";
+            }
+        };
+        out << "  " << stageName(index) << ": " << frames;
+        print(true, perFrame[Cycles]);
+        print(has(Instructions), perFrame[Instructions]);
+        print(has(Instructions) && perFrame[Cycles] > 0.0, perFrame[Instructions] / perFrame[Cycles]);
+        print(has(CacheMisses), perFrame[CacheMisses]);
+        print(has(CacheMisses) && has(Instructions) && perFrame[Instructions] > 0.0, perFrame[CacheMisses] * 1000.0 / perFrame[Instructions]);
+        print(has(BranchMisses), perFrame[BranchMisses]);
+        print(has(BranchMisses) && has(Branches) && perFrame[Branches] > 0.0, perFrame[BranchMisses] * 100.0 / perFrame[Branches]);
+        out << std::endl;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// The stages of the frame loop whose hardware counters are summed up
+enum class CounterStage { Acquire, Segment, Geometry, Control, Count };
+
+// Cycles, instructions, cache misses, branches and branch misses per stage from perf_event_open(2), counted in user
+// space only. Every thread opens a counter group of its own the first time it measures a stage, so the counters of
+// a stage only see the thread that runs it. Counters that cannot be opened (no PMU in a VM, perf_event_paranoid
+// or seccomp in a container, not Linux) are left out of the tables; without any counter StageCounters does nothing.
+// When the kernel multiplexes the group, the values are scaled by the share of the time it was counting.
+
+// Turns the counters on and opens the group of the calling thread. Returns false with the reason in error if
+// not even the cycle counter can be opened; the counters then stay off.
+bool startPerfCounters(std::string &error);
+
+// Adds the counts from its construction to its destruction to a stage.
+class StageCounters {
+   public:
+    explicit StageCounters(CounterStage stage);
+    ~StageCounters();
+    StageCounters(const StageCounters &) = delete;
+    StageCounters &operator=(const StageCounters &) = delete;
+
+   private:
+    CounterStage m_stage;
+    bool m_valid;
+    uint64_t m_before[8];
+};
+
+// Prints the counts per frame, the IPC, the cache misses per 1000 instructions and the branch miss rate of every
+// stage that has been measured.
+void printPerfCounters(std::ostream &out);
+
+#endif
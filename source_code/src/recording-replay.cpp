@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "recording-replay.hpp"
+#include "opendlv-standard-message-set.hpp"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+
+namespace {
+
+// True if the h264 data holds a sequence parameter set or an IDR slice, from where on the stream can be decoded
+bool startsKeyFrame(const std::string &data) {
+    for (size_t i = 0; i + 3 < data.size(); i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            const int type = data[i + 3] & 0x1f;
+            if (type == 5 || type == 7) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool writeAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        const ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if (result <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+}  // namespace
+
+RecordingReplay::RecordingReplay(const std::string &file, uint32_t width, uint32_t height)
+    : m_messages()
+    , m_sampleTimes()
+    , m_nextMessage(0)
+    , m_nextFrame(0)
+    , m_width(width)
+    , m_height(height)
+    , m_capture()
+    , m_decoded()
+    , m_frame()
+    , m_decodeSeconds(0.0)
+    , m_error() {
+    cluon::Player player(file, false, false);
+    if (player.totalNumberOfEnvelopesInRecFile() == 0) {
+        m_error = "cannot read any message from " + file;
+        return;
+    }
+    char stream[] = "/tmp/steering-replay-XXXXXX.h264";
+    const int fd = ::mkstemps(stream, 5);
+    if (fd == -1) {
+        m_error = "cannot create a temporary file for the h264 stream";
+        return;
+    }
+    bool written = true;
+    while (written && player.hasMoreData()) {
+        std::pair<bool, cluon::data::Envelope> next = player.getNextEnvelopeToBeReplayed();
+        if (!next.first) {
+            break;
+        }
+        if (next.second.dataType() != opendlv::proxy::ImageReading::ID()) {
+            m_messages.emplace_back(frames(), std::move(next.second));
+            continue;
+        }
+        const cluon::data::TimeStamp sampleTime = next.second.sampleTimeStamp();
+        opendlv::proxy::ImageReading image = cluon::extractMessage<opendlv::proxy::ImageReading>(std::move(next.second));
+        if (image.fourcc() != "h264") {
+            m_error = "only h264 frames can be replayed, the recording has " + image.fourcc();
+            break;
+        }
+        if (image.width() != m_width || image.height() != m_height) {
+            m_error = "the recording has frames of " + std::to_string(image.width()) + "x" + std::to_string(image.height());
+            break;
+        }
+        //The frames before the first key frame cannot be decoded; their messages go with the first one that can
+        if (m_sampleTimes.empty() && !startsKeyFrame(image.data())) {
+            continue;
+        }
+        m_sampleTimes.push_back(sampleTime);
+        written = writeAll(fd, image.data());
+    }
+    ::close(fd);
+    if (!written) {
+        m_error = "cannot write the h264 stream into " + std::string(stream);
+    } else if (m_error.empty() && m_sampleTimes.empty()) {
+        m_error = "no h264 key frame in " + file;
+    } else if (m_error.empty() && !m_capture.open(stream)) {
+        m_error = "OpenCV cannot decode h264, it needs to be built with FFmpeg";
+    }
+    //The decoder keeps the file open, so the name can go right away
+    ::unlink(stream);
+    if (m_error.empty()) {
+        m_frame.create(static_cast<int>(m_height), static_cast<int>(m_width), CV_8UC4);
+    }
+}
+
+bool RecordingReplay::decode() {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!m_capture.read(m_decoded) || m_decoded.cols != m_frame.cols || m_decoded.rows != m_frame.rows) {
+        m_error = "the decoder stopped at frame " + std::to_string(m_nextFrame);
+        return false;
+    }
+    cv::cvtColor(m_decoded, m_frame, cv::COLOR_BGR2BGRA);
+    m_nextFrame++;
+    m_decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
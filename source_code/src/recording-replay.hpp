@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RECORDING_REPLAY_HPP
+#define RECORDING_REPLAY_HPP
+
+#include "cluon-complete.hpp"
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Stands in for the camera producer with the frames of a .rec file, as fast as they can be decoded.
+// The h264 data of the opendlv.proxy.ImageReading messages is written into a temporary elementary stream that
+// cv::VideoCapture decodes, so nothing beyond an OpenCV with FFmpeg is needed. The stream starts at the first key
+// frame of the recording, from where on every ImageReading gives one decoded frame. The other messages are handed
+// out with the frame that follows them, so the steering sees them in the order in which they were recorded.
+class RecordingReplay {
+   public:
+    // Reads the whole recording; valid() tells whether it holds h264 frames of width x height.
+    RecordingReplay(const std::string &file, uint32_t width, uint32_t height);
+
+    bool valid() const {
+        return m_error.empty();
+    }
+    const std::string &error() const {
+        return m_error;
+    }
+    // Frames that decodeNext() will return
+    uint32_t frames() const {
+        return static_cast<uint32_t>(m_sampleTimes.size());
+    }
+
+    // Hands the messages recorded before the next frame to onMessage(cluon::data::Envelope &&) and decodes the frame.
+    // Returns false after the last frame or when the decoder fails.
+    template <typename Handler>
+    bool decodeNext(Handler &&onMessage) {
+        if (m_nextFrame >= frames()) {
+            return false;
+        }
+        for (; m_nextMessage < m_messages.size() && m_messages[m_nextMessage].first <= m_nextFrame; m_nextMessage++) {
+            onMessage(std::move(m_messages[m_nextMessage].second));
+        }
+        return decode();
+    }
+
+    // The last decoded frame, 4 channels like the frames in the shared memory
+    const cv::Mat &frame() const {
+        return m_frame;
+    }
+    // Sample time of the ImageReading of the last decoded frame
+    const cluon::data::TimeStamp &sampleTime() const {
+        return m_sampleTimes[m_nextFrame - 1];
+    }
+    // Time spent in the decoder so far
+    double decodeSeconds() const {
+        return m_decodeSeconds;
+    }
+
+   private:
+    bool decode();
+
+    std::vector<std::pair<uint32_t, cluon::data::Envelope> > m_messages;  //the frame that follows each message
+    std::vector<cluon::data::TimeStamp> m_sampleTimes;
+    size_t m_nextMessage;
+    uint32_t m_nextFrame;
+    uint32_t m_width;
+    uint32_t m_height;
+    cv::VideoCapture m_capture;
+    cv::Mat m_decoded;
+    cv::Mat m_frame;
+    double m_decodeSeconds;
+    std::string m_error;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scanline-detector.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+ScanlineDetector::ScanlineDetector()
+    : m_matrix()
+    , m_size()
+    , m_bottom(0)
+    , m_rows()
+    , m_sources()
+    , m_pixels()
+    , m_blueRow()
+    , m_yellowRow()
+    , m_blueCones()
+    , m_yellowCones() {
+}
+
+void ScanlineDetector::update(const cv::Mat &matrix, cv::Size size, int scanlines, int bottom) {
+    CV_Assert(matrix.type() == CV_64FC1 && matrix.rows == 3 && matrix.cols == 3 && scanlines > 0);
+    const cv::Matx33d homography(matrix.ptr<double>(0));
+    bottom = std::min(bottom, size.height);
+    if (homography == m_matrix && size == m_size && bottom == m_bottom && static_cast<int>(m_rows.size()) == scanlines) {
+        return;
+    }
+    m_matrix = homography;
+    m_size = size;
+    m_bottom = bottom;
+
+    m_rows.resize(static_cast<size_t>(scanlines));
+    for (int i = 0; i < scanlines; i++) {
+        m_rows[static_cast<size_t>(i)] = static_cast<int>(bottom - (i + 0.5) * bottom / scanlines);
+    }
+    //The same mapping as warpPerspective(): a bird's-eye pixel takes the camera pixel that the inverse lands on
+    const cv::Matx33d inverse = homography.inv();
+    m_sources.resize(static_cast<size_t>(scanlines) * size.width);
+    for (int i = 0; i < scanlines; i++) {
+        for (int x = 0; x < size.width; x++) {
+            const cv::Vec3d p = inverse * cv::Vec3d(x, m_rows[static_cast<size_t>(i)], 1.0);
+            cv::Point source(-1, -1);
+            if (p[2] != 0.0) {
+                source = cv::Point(cvRound(p[0] / p[2]), cvRound(p[1] / p[2]));
+            }
+            if (source.x < 0 || source.x >= size.width || source.y < 0 || source.y >= size.height) {
+                source = cv::Point(-1, -1);
+            }
+            m_sources[static_cast<size_t>(i) * size.width + x] = source;
+        }
+    }
+    m_pixels.resize(static_cast<size_t>(size.width) * 3);
+    m_blueRow.resize(static_cast<size_t>(size.width));
+    m_yellowRow.resize(static_cast<size_t>(size.width));
+}
+
+void ScanlineDetector::addRuns(const uint8_t *row, int scanline, int minRun, std::vector<Cone> &cones) {
+    const int width = m_size.width;
+    const double y = m_rows[static_cast<size_t>(scanline)];
+    for (int x = 0; x < width;) {
+        if (row[x] == 0) {
+            x++;
+            continue;
+        }
+        const int x0 = x;
+        while (x < width && row[x] != 0) {
+            x++;
+        }
+        if (x - x0 < minRun) {
+            continue;
+        }
+        const double length = x - x0;
+        const double centre = (x0 + x - 1) * 0.5;
+        //A run belongs to a cone whose run on the scanline below overlaps it
+        Cone *cone = nullptr;
+        for (Cone &candidate : cones) {
+            if (candidate.scanline == scanline - 1 && candidate.x0 < x && x0 < candidate.x1) {
+                cone = &candidate;
+                break;
+            }
+        }
+        if (cone == nullptr) {
+            cones.push_back(Cone{0.0, 0.0, 0.0, scanline, x0, x});
+            cone = &cones.back();
+        }
+        cone->sumX += centre * length;
+        cone->sumY += y * length;
+        cone->length += length;
+        cone->scanline = scanline;
+        cone->x0 = x0;
+        cone->x1 = x;
+    }
+}
+
+void ScanlineDetector::finish(std::vector<Cone> &cones, std::vector<cv::Point2f> &positions) {
+    positions.clear();
+    for (const Cone &cone : cones) {
+        positions.push_back(cv::Point2f(static_cast<float>(cone.sumX / cone.length), static_cast<float>(cone.sumY / cone.length)));
+    }
+    std::sort(positions.begin(), positions.end(), [](const cv::Point2f &a, const cv::Point2f &b) { return a.y > b.y; });
+}
+
+void ScanlineDetector::detect(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow, int minRun,
+                              std::vector<cv::Point2f> &blueCones, std::vector<cv::Point2f> &yellowCones,
+                              std::vector<int> *blueColumns) {
+    CV_Assert(image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 4) && image.size() == m_size);
+    const int width = m_size.width;
+    const int channels = image.channels();
+    m_blueCones.clear();
+    m_yellowCones.clear();
+    if (blueColumns != nullptr) {
+        blueColumns->assign(static_cast<size_t>(width), 0);
+    }
+
+    for (size_t i = 0; i < m_rows.size(); i++) {
+        //The samples of a scanline are gathered into one BGR row, so the row kernel of the segmentation can classify them
+        const cv::Point *sources = &m_sources[i * width];
+        for (int x = 0; x < width; x++) {
+            uint8_t *pixel = &m_pixels[static_cast<size_t>(x) * 3];
+            if (sources[x].x < 0) {
+                pixel[0] = pixel[1] = pixel[2] = 0;  //black is in neither range
+                continue;
+            }
+            const uint8_t *source = image.ptr<uint8_t>(sources[x].y) + sources[x].x * channels;
+            pixel[0] = source[0];
+            pixel[1] = source[1];
+            pixel[2] = source[2];
+        }
+        segmentRowScalar(m_pixels.data(), 3, width, blue, yellow, m_blueRow.data(), m_yellowRow.data());
+        addRuns(m_blueRow.data(), static_cast<int>(i), minRun, m_blueCones);
+        addRuns(m_yellowRow.data(), static_cast<int>(i), minRun, m_yellowCones);
+        if (blueColumns != nullptr) {
+            for (int x = 0; x < width; x++) {
+                (*blueColumns)[static_cast<size_t>(x)] += m_blueRow[static_cast<size_t>(x)] != 0;
+            }
+        }
+    }
+    finish(m_blueCones, blueCones);
+    finish(m_yellowCones, yellowCones);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCANLINE_DETECTOR_HPP
+#define SCANLINE_DETECTOR_HPP
+
+#include "cone-segmentation.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <vector>
+
+// Finds the cones on a few rows of the bird's-eye view without warping or segmenting the frame. Every pixel of a
+// scanline is mapped back through the inverse homography once, when the sliders change; per frame only those
+// camera pixels are classified. Runs of one colour on neighbouring scanlines that overlap are joined into one
+// cone, whose position is the mean of the run centres weighted by their length.
+class ScanlineDetector {
+   public:
+    ScanlineDetector();
+
+    // Rebuilds the sample table if the homography (camera to bird's-eye view, CV_64FC1), the size of the view
+    // or the scanlines have changed. The scanlines are spread evenly over the rows above bottom.
+    void update(const cv::Mat &matrix, cv::Size size, int scanlines, int bottom);
+
+    // Classifies the samples of a CV_8UC3 or CV_8UC4 frame and returns the cones in bird's-eye coordinates,
+    // the lowest one first like extractBlobs(). Runs shorter than minRun px are ignored. If blueColumns is given
+    // it is set to the number of blue samples in every column of the bird's-eye view.
+    void detect(const cv::Mat &image, const HsvRange &blue, const HsvRange &yellow, int minRun,
+                std::vector<cv::Point2f> &blueCones, std::vector<cv::Point2f> &yellowCones,
+                std::vector<int> *blueColumns = nullptr);
+
+   private:
+    // Cone that is being built up from the runs of consecutive scanlines
+    struct Cone {
+        double sumX;
+        double sumY;
+        double length;
+        int scanline;  //last scanline with a run of this cone
+        int x0;        //that run, [x0, x1)
+        int x1;
+    };
+
+    void addRuns(const uint8_t *row, int scanline, int minRun, std::vector<Cone> &cones);
+    static void finish(std::vector<Cone> &cones, std::vector<cv::Point2f> &positions);
+
+    cv::Matx33d m_matrix;
+    cv::Size m_size;
+    int m_bottom;
+    std::vector<int> m_rows;          //bird's-eye row of every scanline, from the bottom up
+    std::vector<cv::Point> m_sources; //camera pixel of every sample, scanline by scanline; x = -1 outside the frame
+    std::vector<uint8_t> m_pixels;    //BGR of the samples of one scanline
+    std::vector<uint8_t> m_blueRow;
+    std::vector<uint8_t> m_yellowRow;
+    std::vector<Cone> m_blueCones;
+    std::vector<Cone> m_yellowCones;
+};
+
+#endif
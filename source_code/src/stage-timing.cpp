@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stage-timing.hpp"
+
+const char *stageName(Stage stage) {
+    switch (stage) {
+        case Stage::Wait:
+            return "wait";
+        case Stage::Copy:
+            return "copy";
+        case Stage::Segmentation:
+            return "segmentation";
+        case Stage::NoiseReduction:
+            return "noise reduction";
+        case Stage::Warp:
+            return "warp";
+        case Stage::Contours:
+            return "contours";
+        case Stage::Steering:
+            return "steering";
+        case Stage::Output:
+            return "output";
+        default:
+            return "unknown";
+    }
+}
+
+#ifdef STAGE_TIMING
+
+#include "thread-registry.hpp"
+
+#include <atomic>
+#include <vector>
+
+namespace {
+
+const int STAGES = static_cast<int>(Stage::Count);
+const int SUB_BITS = 5;
+const int SUB_BUCKETS = 1 << SUB_BITS;
+// Values up to 2^40 ns (about 18 minutes) get their own bucket, longer ones go into the last
+const int MAX_EXPONENT = 40;
+const int BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+int bucketOf(uint64_t value) {
+    if (value < static_cast<uint64_t>(SUB_BUCKETS)) {
+        return static_cast<int>(value);
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) {
+        return BUCKETS - 1;
+    }
+    const int mantissa = static_cast<int>(value >> (exponent - SUB_BITS));
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + (mantissa - SUB_BUCKETS);
+}
+
+// Largest value that falls into a bucket
+uint64_t bucketLimit(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return static_cast<uint64_t>(bucket);
+    }
+    const int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    const uint64_t mantissa = static_cast<uint64_t>(bucket % SUB_BUCKETS + SUB_BUCKETS);
+    return ((mantissa + 1) << (exponent - SUB_BITS)) - 1;
+}
+
+// Only the owning thread writes, so a relaxed load and store is enough and no locked instruction is needed
+struct ThreadHistograms {
+    std::atomic<uint64_t> counts[STAGES][BUCKETS];
+    std::atomic<uint64_t> max[STAGES];
+};
+
+ThreadRegistry<ThreadHistograms> registry;
+
+ThreadHistograms &histograms() {
+    return registry.own([](size_t) {
+        ThreadHistograms *created = new ThreadHistograms();
+        for (int stage = 0; stage < STAGES; stage++) {
+            for (int bucket = 0; bucket < BUCKETS; bucket++) {
+                created->counts[stage][bucket].store(0, std::memory_order_relaxed);
+            }
+            created->max[stage].store(0, std::memory_order_relaxed);
+        }
+        return created;
+    });
+}
+
+}  // namespace
+
+void StageTimer::stop(Stage stage) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    recordStageLatency(stage, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start).count()));
+    m_start = now;
+}
+
+void recordStageLatency(Stage stage, uint64_t nanoseconds) {
+    ThreadHistograms &own = histograms();
+    const int index = static_cast<int>(stage);
+    std::atomic<uint64_t> &count = own.counts[index][bucketOf(nanoseconds)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (nanoseconds > own.max[index].load(std::memory_order_relaxed)) {
+        own.max[index].store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+void printStageLatencies(std::ostream &out) {
+    std::vector<uint64_t> merged(static_cast<size_t>(BUCKETS));
+    out << "stage latencies in us (count p50 p99 p99.9 max):" << std::endl;
+    for (int stage = 0; stage < STAGES; stage++) {
+        uint64_t total = 0;
+        uint64_t max = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++) {
+            merged[static_cast<size_t>(bucket)] = 0;
+        }
+        registry.forEach([&](const ThreadHistograms &thread) {
+            for (int bucket = 0; bucket < BUCKETS; bucket++) {
+                merged[static_cast<size_t>(bucket)] += thread.counts[stage][bucket].load(std::memory_order_relaxed);
+            }
+            const uint64_t threadMax = thread.max[stage].load(std::memory_order_relaxed);
+            max = (threadMax > max) ? threadMax : max;
+        });
+        for (uint64_t count : merged) {
+            total += count;
+        }
+        if (total == 0) {
+            continue;
+        }
+
+        const double quantiles[3] = {0.5, 0.99, 0.999};
+        double values[3] = {0.0, 0.0, 0.0};
+        int next = 0;
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS && next < 3; bucket++) {
+            seen += merged[static_cast<size_t>(bucket)];
+            while (next < 3 && static_cast<double>(seen) >= quantiles[next] * static_cast<double>(total)) {
+                //The bucket limit can lie above the largest value that was recorded
+                const uint64_t limit = bucketLimit(bucket);
+                values[next++] = static_cast<double>((limit < max) ? limit : max) / 1000.0;
+            }
+        }
+        out << "  " << stageName(static_cast<Stage>(stage)) << ": " << total << " " << values[0] << " " << values[1]
+            << " " << values[2] << " " << static_cast<double>(max) / 1000.0 << std::endl;
+    }
+}
+
+void installStageReportSignal() {
+    PolledSignal<SIGUSR1>::install();
+}
+
+bool stageReportRequested() {
+    return PolledSignal<SIGUSR1>::requested();
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STAGE_TIMING_HPP
+#define STAGE_TIMING_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// The parts of a frame whose latency is recorded
+enum class Stage { Wait, Copy, Segmentation, NoiseReduction, Warp, Contours, Steering, Output, Count };
+
+const char *stageName(Stage stage);
+
+// Latency histograms per stage, only compiled in with -D STAGE_TIMING=ON. Otherwise StageTimer is empty and
+// every call below is an inline no-op, so the timers in the frame loop cost nothing.
+// Every thread records into histograms of its own (log-linear buckets, 32 per power of two, so a value is
+// off by at most 1/32); printing merges them while the threads keep recording.
+#ifdef STAGE_TIMING
+const bool STAGE_TIMING_ENABLED = true;
+
+// Records the time since its construction or its last stop() for a stage and starts again.
+class StageTimer {
+   public:
+    StageTimer()
+        : m_start(std::chrono::steady_clock::now()) {}
+
+    void stop(Stage stage);
+
+   private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+void recordStageLatency(Stage stage, uint64_t nanoseconds);
+// Prints the count, p50, p99, p99.9 and the maximum of every stage that has been recorded, in microseconds.
+void printStageLatencies(std::ostream &out);
+// Makes SIGUSR1 request a report, which stageReportRequested() returns once (see PolledSignal).
+void installStageReportSignal();
+bool stageReportRequested();
+#else
+const bool STAGE_TIMING_ENABLED = false;
+
+class StageTimer {
+   public:
+    void stop(Stage) {}
+};
+
+inline void printStageLatencies(std::ostream &) {}
+inline void installStageReportSignal() {}
+inline bool stageReportRequested() {
+    return false;
+}
+#endif
+
+#endif
@@ -19,6 +19,17 @@
 #include "cluon-complete.hpp"
 // Include the OpenDLV Standard Message Set that contains messages that are usually exchanged for automotive or robotic applications
 #include "opendlv-standard-message-set.hpp"
+#include "cone-segmentation.hpp"
+#include "cone-tracker.hpp"
+#include "scanline-detector.hpp"
+#include "stage-timing.hpp"
+#include "frame-trace.hpp"
+#include "perf-counters.hpp"
+#include "recording-replay.hpp"
+#include "allocation-counter.hpp"
+#include "frame-pipeline.hpp"
+#include "frame-skipping.hpp"
+#include "steering-stages.hpp"
 //matplot python library wrapped for c++
 
  
@@ -29,7 +40,12 @@
 #include <opencv2/videoio.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cmath>
+#include <thread>
 #include <vector>
 
 const int alpha_slider_max = 640;
@@ -41,50 +57,126 @@ int slider_x_right = 508;
 
 
 
-double alpha;
-double beta;
-
 int bMinHue= 42, bMinSat=99, bMinVal= 44, bMaxHue=155, bMaxSat=200, bMaxVal=79;
 int yMinHue= 18, yMinSat=101, yMinVal= 104, yMaxHue=53, yMaxSat=255, yMaxVal=255;
 
-cv::Mat blueCones;
-cv::Mat yellowCones;
-
 using namespace cv;
 
-Mat applyFilter(Mat img, int minHue, int minSat, int minVal, int maxHue, int maxSat, int maxVal);
-std::vector<cv::Point2f>  findCoordinates(std::vector<std::vector<cv::Point> > contours);
-Mat reduceNoise(Mat image);
-Mat applyWarp(Mat image);
-double calculateInverse(double bLength, double cLength);
-double calculateAngle(double inverse);
-static void makeTrackbar(Mat image, int WIDTH, int HEIGHT);
+void buildWarpMaps(Size size);
 static void on_trackbar( int, void* );
-bool checkSide(Mat image);
-bool conesLeft;
-double grndSteerAngle = 0;
-int coneDecider=0;
-int ind = 0;
-double dis;
-cv::Mat img;
 cv::Mat slider_dst;
 
+//The homography and the remap tables only depend on the sliders, so they are kept between frames.
+//They are rebuilt on the next warp of a frame whose quad differs from the cached one.
+//Only the geometry stage writes to the cache; its branches only read it (see prepareWarp()).
+struct WarpCache {
+    bool valid;
+    WarpQuad quad;
+    Mat matrix;
+    Mat map1;  //CV_16SC2: integer source coordinates for every warped pixel
+    Mat map2;  //CV_16UC1: index into remap's bilinear interpolation table
+};
+WarpCache warpCache{false, {0, 0, 0}, Mat(), Mat(), Mat()};
+
+//The sliders belong to the thread that runs the GUI. The other stages read the quad that the control stage
+//publishes after every frame, packed into one word so that the three values always belong together.
+std::atomic<uint64_t> publishedQuad{0};
+
+//Frames in flight with --pipeline (a power of two, it is also the capacity of the queues between the stages)
+const size_t PIPELINE_SLOTS = 4;
+//With --pipeline --verbose the queue statistics are printed every this many frames
+const uint32_t PIPELINE_STATS_INTERVAL = 100;
+//With --trace the timeline keeps this many of the last events of every thread, a few minutes of frames
+const size_t TRACE_EVENTS_PER_THREAD = 1 << 16;
+
+
+//Prints the command line options; main() prints it when a mandatory option is missing
+static void printUsage(const char *program) {
+    std::cerr << program << " attaches to a shared memory area containing an ARGB image." << std::endl;
+    std::cerr << "Usage:   " << program << " --cid=<OD4 session> --name=<name of shared memory area> --width=<px> --height=<px>" << std::endl;
+    std::cerr << "         " << program << " --replay=<file.rec> --width=<px> --height=<px>" << std::endl;
+    std::cerr << "         segmentation: [--segmentation=split|fused|lut] [--simd=auto|scalar|sse4.1|avx2] [--verify-segmentation]" << std::endl;
+    std::cerr << "                       [--cleanup=canny|morphology|components] [--packed-masks] [--strips=<rows>] [--compare-strips]" << std::endl;
+    std::cerr << "         geometry:     [--warp=image|centroids] [--centroids=contours|components] [--coarse=2|4] [--compare-coarse]" << std::endl;
+    std::cerr << "                       [--track=<frames>] [--scanlines=<rows>] [--compare-warp] [--side=once|continuous]" << std::endl;
+    std::cerr << "         frames:       [--full-frame] [--acquire=full|rows] [--reuse-unchanged] [--skip-behind] [--pipeline]" << std::endl;
+    std::cerr << "                       [--parallel-branches]" << std::endl;
+    std::cerr << "         diagnostics:  [--verbose] [--frame-age] [--trace=<file>] [--perf-counters] [--check-allocations]" << std::endl;
+    std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
+    std::cerr << "         --name:   name of the shared memory area to attach" << std::endl;
+    std::cerr << "         --width:  width of the frame" << std::endl;
+    std::cerr << "         --height: height of the frame" << std::endl;
+    std::cerr << "         --segmentation: split (default) runs applyFilter() once per colour, fused classifies both colours in one pass," << std::endl;
+    std::cerr << "                   lut classifies both colours with one lookup per pixel in a quantised BGR table" << std::endl;
+    std::cerr << "         --simd:   row kernel for fused segmentation; auto (default) picks the widest one the CPU supports," << std::endl;
+    std::cerr << "                   a kernel that the CPU does not support is an error" << std::endl;
+    std::cerr << "         --verify-segmentation: compare every fused mask against the scalar reference, report mismatches" << std::endl;
+    std::cerr << "                   and exit with an error if there was one" << std::endl;
+    std::cerr << "         --warp:   image (default) warps both masks into the bird's-eye view, centroids only warps the cone centroids" << std::endl;
+    std::cerr << "         --cleanup: canny (default) blurs the masks and keeps the Canny edges, morphology opens and closes them," << std::endl;
+    std::cerr << "                   components drops blobs smaller than " << MIN_CONE_AREA << " px; the last two keep the blobs filled" << std::endl;
+    std::cerr << "         --centroids: contours (default) uses findContours() and the contour moments, components labels the mask" << std::endl;
+    std::cerr << "                   once and takes the centroids of the blobs with at least " << MIN_CONE_AREA << " px" << std::endl;
+    std::cerr << "         --packed-masks: keep the masks with one bit per pixel where possible: the fused and lut segmentation" << std::endl;
+    std::cerr << "                   write them, --cleanup=morphology works on them and --warp=centroids --centroids=components" << std::endl;
+    std::cerr << "                   finds the blobs on them" << std::endl;
+    std::cerr << "         --side:   once (default) decides from the first frame on which side the blue cones are, continuous" << std::endl;
+    std::cerr << "                   decides on every frame from the blue pixels per column counted during the segmentation" << std::endl;
+    std::cerr << "         --coarse: segment every 2nd or 4th pixel of every 2nd or 4th row, find the blobs on these small masks" << std::endl;
+    std::cerr << "                   and refine their centroids on full-resolution windows around them; implies --warp=centroids" << std::endl;
+    std::cerr << "                   and replaces --segmentation, --cleanup and --centroids" << std::endl;
+    std::cerr << "         --compare-coarse: with --coarse, also run fused segmentation, Canny and findContours() on the full" << std::endl;
+    std::cerr << "                   frame and report how far the coarse centroids are off and how long both take" << std::endl;
+    std::cerr << "         --track: follow the cones with an alpha-beta filter and segment the whole ROI only every <frames> frames" << std::endl;
+    std::cerr << "                   or after a cone was lost, else only windows around the predicted cones; implies --warp=centroids" << std::endl;
+    std::cerr << "         --strips: segment and clean up the ROI in strips of <rows> rows (plus " << STRIP_HALO << " rows above and below)," << std::endl;
+    std::cerr << "                   so that every strip is still in cache for the cleanup; not with --cleanup=components or" << std::endl;
+    std::cerr << "                   --packed-masks, Canny can differ from the whole ROI where an edge is only linked across strips" << std::endl;
+    std::cerr << "         --compare-strips: with --strips, also segment and clean up the whole ROI, and report the pixels that" << std::endl;
+    std::cerr << "                   differ and how long both take" << std::endl;
+    std::cerr << "         --compare-warp: segment every frame once more and report the pixels of the bird's-eye view that differ" << std::endl;
+    std::cerr << "                   between applyWarp() and warpPerspective() and how far the cones move with --warp=centroids" << std::endl;
+    std::cerr << "         --scanlines: only classify the camera pixels under <rows> rows of the bird's-eye view above row " << SCANLINE_BOTTOM << std::endl;
+    std::cerr << "                   and find the cones from the runs of one colour on them; nothing is segmented or warped." << std::endl;
+    std::cerr << "                   Replaces --segmentation, --cleanup, --centroids, --warp, --coarse and --track" << std::endl;
+    std::cerr << "         --reuse-unchanged: send the last steering again instead of processing a frame while the car stands" << std::endl;
+    std::cerr << "                   still or while the frame hardly differs from the last processed one; with --track the" << std::endl;
+    std::cerr << "                   tracks are still moved ahead on these frames" << std::endl;
+    std::cerr << "         --skip-behind: with --pipeline, drop a new frame while the oldest one in it is older than one producer" << std::endl;
+    std::cerr << "                   frame period; no effect with --replay or without --pipeline, where the loop takes the newest frame" << std::endl;
+    std::cerr << "         --frame-age: print for every frame how long after its time stamp in the shared memory it was acquired" << std::endl;
+    std::cerr << "                   and steered; the averages and maxima are always printed at exit" << std::endl;
+    std::cerr << "         --trace: record a timeline of the stages, branches, OD4 callbacks and held mutexes and write it into <file>" << std::endl;
+    std::cerr << "                   at exit and on SIGUSR2, for chrome://tracing or ui.perfetto.dev" << std::endl;
+    std::cerr << "         --perf-counters: count cycles, instructions, cache and branch misses of every stage with perf_event_open" << std::endl;
+    std::cerr << "                   and print them at exit; without access to the counters the service runs without them" << std::endl;
+    std::cerr << "         --replay: instead of the shared memory and the OD4 session, decode the h264 frames of a recording" << std::endl;
+    std::cerr << "                   and steer on them as fast as possible, with the recorded steering and distance messages;" << std::endl;
+    std::cerr << "                   prints the frames/s and the latencies at the end. --cid and --name are not needed" << std::endl;
+    std::cerr << "         --full-frame: process the whole frame instead of the rows of the warp source quad" << std::endl;
+    std::cerr << "         --acquire: full (default) copies the whole frame out of the shared memory, rows only copies the rows" << std::endl;
+    std::cerr << "                   that are processed, so that the producer is blocked for a shorter time" << std::endl;
+    std::cerr << "         --verbose: show the frames and the sliders; they are drawn on a thread of their own that skips frames" << std::endl;
+    std::cerr << "                   instead of holding up the steering. Without it no OpenCV window is opened." << std::endl;
+    std::cerr << "         --pipeline: run acquisition, segmentation, geometry and control/output on their own threads;" << std::endl;
+    std::cerr << "                   queue depths and drops are printed on exit and every " << PIPELINE_STATS_INTERVAL << " frames with --verbose" << std::endl;
+    std::cerr << "         --parallel-branches: process the blue and the yellow cones of a frame on two threads" << std::endl;
+    std::cerr << "         --check-allocations: report heap allocations per frame, OpenCV buffers included (needs -D COUNT_ALLOCATIONS=ON);" << std::endl;
+    std::cerr << "                   fails on a frame after the warm-up that allocates with --segmentation=fused|lut --packed-masks" << std::endl;
+    std::cerr << "                   --cleanup=morphology --warp=centroids --centroids=components, whose OpenCV calls do not allocate" << std::endl;
+    std::cerr << "Example: " << program << " --cid=253 --name=img --width=640 --height=480 --verbose" << std::endl;
+    std::cerr << "         " << program << " --replay=CID-140-recording-2020-03-18_144821-selection.rec --width=640 --height=480" << std::endl;
+}
 
 int32_t main(int32_t argc, char **argv) {
     int32_t retCode{1};
     // Parse the command line parameters as we require the user to specify some mandatory information on startup.
     auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
-    if ( (0 == commandlineArguments.count("cid")) ||
-         (0 == commandlineArguments.count("name")) ||
+    if ( (((0 == commandlineArguments.count("cid")) ||
+           (0 == commandlineArguments.count("name"))) && (0 == commandlineArguments.count("replay"))) ||
          (0 == commandlineArguments.count("width")) ||
          (0 == commandlineArguments.count("height")) ) {
-        std::cerr << argv[0] << " attaches to a shared memory area containing an ARGB image." << std::endl;
-        std::cerr << "Usage:   " << argv[0] << " --cid=<OD4 session> --name=<name of shared memory area> [--verbose]" << std::endl;
-        std::cerr << "         --cid:    CID of the OD4Session to send and receive messages" << std::endl;
-        std::cerr << "         --name:   name of the shared memory area to attach" << std::endl;
-        std::cerr << "         --width:  width of the frame" << std::endl;
-        std::cerr << "         --height: height of the frame" << std::endl;
-        std::cerr << "Example: " << argv[0] << " --cid=253 --name=img --width=640 --height=480 --verbose" << std::endl;
+        printUsage(argv[0]);
     }
     else {
         // Extract the values from the command line parameters
@@ -92,271 +184,487 @@ int32_t main(int32_t argc, char **argv) {
         const uint32_t WIDTH{static_cast<uint32_t>(std::stoi(commandlineArguments["width"]))};
         const uint32_t HEIGHT{static_cast<uint32_t>(std::stoi(commandlineArguments["height"]))};
         const bool VERBOSE{commandlineArguments.count("verbose") != 0};
+        const std::string SEGMENTATION{(commandlineArguments.count("segmentation") != 0) ? commandlineArguments["segmentation"] : "split"};
+        const bool FUSED_SEGMENTATION{SEGMENTATION == "fused"};
+        const bool LUT_SEGMENTATION{SEGMENTATION == "lut"};
+        const std::string SIMD{(commandlineArguments.count("simd") != 0) ? commandlineArguments["simd"] : "auto"};
+        SegmentationKernel KERNEL{SegmentationKernel::Scalar};
+        const bool KERNEL_SUPPORTED{parseSegmentationKernel(SIMD, KERNEL)};
+        const bool VERIFY_SEGMENTATION{commandlineArguments.count("verify-segmentation") != 0};
+        const MaskCleanup CLEANUP{parseMaskCleanup((commandlineArguments.count("cleanup") != 0) ? commandlineArguments["cleanup"] : "canny")};
+        const bool COMPONENT_CENTROIDS{(commandlineArguments.count("centroids") != 0) && (commandlineArguments["centroids"] == "components")};
+        const bool PACKED_MASKS{commandlineArguments.count("packed-masks") != 0};
+        const bool PACKED_SEGMENTATION{PACKED_MASKS && (FUSED_SEGMENTATION || LUT_SEGMENTATION)};
+        const bool PACKED_CLEANUP{PACKED_MASKS && (CLEANUP == MaskCleanup::Morphology)};
+        const bool CONTINUOUS_SIDE{(commandlineArguments.count("side") != 0) && (commandlineArguments["side"] == "continuous")};
+        const int SCANLINES{(commandlineArguments.count("scanlines") != 0) ? std::max(0, std::stoi(commandlineArguments["scanlines"])) : 0};
+        const int REQUESTED_COARSE_STEP{(commandlineArguments.count("coarse") != 0) ? std::stoi(commandlineArguments["coarse"]) : 1};
+        const bool COARSE{SCANLINES == 0 && (REQUESTED_COARSE_STEP == 2 || REQUESTED_COARSE_STEP == 4)};
+        const int COARSE_STEP{COARSE ? REQUESTED_COARSE_STEP : 1};
+        const int STRIP_ROWS{(commandlineArguments.count("strips") != 0) ? std::max(0, std::stoi(commandlineArguments["strips"])) : 0};
+        //The connected components and the packed masks need the whole mask at once
+        const bool STRIPS{STRIP_ROWS > 0 && SCANLINES == 0 && !COARSE && CLEANUP != MaskCleanup::Components && !PACKED_MASKS};
+        const bool COMPARE_STRIPS{STRIPS && (commandlineArguments.count("compare-strips") != 0)};
+        const bool COMPARE_COARSE{COARSE && (commandlineArguments.count("compare-coarse") != 0)};
+        const bool COMPARE_WARP{SCANLINES == 0 && (commandlineArguments.count("compare-warp") != 0)};
+        const int TRACK_INTERVAL{(commandlineArguments.count("track") != 0) ? std::stoi(commandlineArguments["track"]) : 1};
+        const bool TRACKING{SCANLINES == 0 && TRACK_INTERVAL > 1};
+        const bool REUSE_UNCHANGED{commandlineArguments.count("reuse-unchanged") != 0};
+        const std::string REPLAY_FILE{(commandlineArguments.count("replay") != 0) ? commandlineArguments["replay"] : ""};
+        const bool PIPELINE{commandlineArguments.count("pipeline") != 0};
+        //Frames of a recording are never dropped, and only the pipeline can fall behind the producer
+        const bool REQUESTED_SKIP_BEHIND{commandlineArguments.count("skip-behind") != 0};
+        const bool SKIP_BEHIND{REQUESTED_SKIP_BEHIND && REPLAY_FILE.empty() && PIPELINE};
+        const bool FRAME_AGE{commandlineArguments.count("frame-age") != 0};
+        const bool PERF_COUNTERS{commandlineArguments.count("perf-counters") != 0};
+        const std::string TRACE_FILE{(commandlineArguments.count("trace") != 0) ? commandlineArguments["trace"] : ""};
+        const bool FULL_FRAME{commandlineArguments.count("full-frame") != 0};
+        const bool WARP_CENTROIDS{COARSE || TRACKING || ((commandlineArguments.count("warp") != 0) && (commandlineArguments["warp"] == "centroids"))};
+        const bool ACQUIRE_ROWS{(commandlineArguments.count("acquire") != 0) && (commandlineArguments["acquire"] == "rows")};
+        const bool PARALLEL_BRANCHES{commandlineArguments.count("parallel-branches") != 0};
+        const bool CHECK_ALLOCATIONS{commandlineArguments.count("check-allocations") != 0};
+        //The only chain without GaussianBlur()/Canny(), morphologyEx(), cvtColor(), findContours() or
+        //connectedComponentsWithStats(), which allocate inside OpenCV on every frame, and without the growing
+        //track and scanline lists; the debug comparisons run the plain OpenCV chain next to it
+        const bool ALLOCATION_FREE{PACKED_SEGMENTATION && PACKED_CLEANUP && WARP_CENTROIDS && COMPONENT_CENTROIDS && !COARSE
+            && !TRACKING && SCANLINES == 0 && !VERIFY_SEGMENTATION && !COMPARE_WARP};
+        const HsvRange blueRange{bMinHue, bMinSat, bMinVal, bMaxHue, bMaxSat, bMaxVal};
+        const HsvRange yellowRange{yMinHue, yMinSat, yMinVal, yMaxHue, yMaxSat, yMaxVal};
  
-        // Attach to the shared memory.
-        std::unique_ptr<cluon::SharedMemory> sharedMemory{new cluon::SharedMemory{NAME}};
-        if (sharedMemory && sharedMemory->valid()) {
-            std::clog << argv[0] << ": Attached to shared memory '" << sharedMemory->name() << " (" << sharedMemory->size() << " bytes)." << std::endl;
+        // Attach to the shared memory, or read the recording that stands in for it.
+        std::unique_ptr<RecordingReplay> replay{REPLAY_FILE.empty() ? nullptr : new RecordingReplay(REPLAY_FILE, WIDTH, HEIGHT)};
+        std::unique_ptr<cluon::SharedMemory> sharedMemory{replay ? nullptr : new cluon::SharedMemory{NAME}};
+        if (!KERNEL_SUPPORTED) {
+            //Falling back to another kernel would let --verify-segmentation pass without checking the requested one
+            std::cerr << argv[0] << ": --simd=" << SIMD << " is unknown or not supported by this CPU, which supports up to "
+                      << segmentationKernelName(detectSegmentationKernel()) << "." << std::endl;
+        }
+        else if (replay && !replay->valid()) {
+            std::cerr << argv[0] << ": Cannot replay " << REPLAY_FILE << ": " << replay->error() << "." << std::endl;
+        }
+        else if (replay || (sharedMemory && sharedMemory->valid())) {
+            if (replay) {
+                std::clog << argv[0] << ": Replaying " << replay->frames() << " frames of " << REPLAY_FILE << " as fast as possible." << std::endl;
+            } else {
+                std::clog << argv[0] << ": Attached to shared memory '" << sharedMemory->name() << " (" << sharedMemory->size() << " bytes)." << std::endl;
+            }
+            const std::string windowName{replay ? REPLAY_FILE : sharedMemory->name()};
+            std::clog << argv[0] << ": Using " << (FUSED_SEGMENTATION ? "fused" : (LUT_SEGMENTATION ? "lut" : "split")) << " cone segmentation";
+            if (FUSED_SEGMENTATION) {
+                std::clog << " with the " << segmentationKernelName(KERNEL) << " kernel";
+            }
+            std::clog << " and " << maskCleanupName(CLEANUP) << " mask cleanup." << std::endl;
+            if (COARSE) {
+                std::clog << argv[0] << ": Finding the cones at 1/" << COARSE_STEP << " resolution and refining them at full resolution." << std::endl;
+            } else if (REQUESTED_COARSE_STEP != 1) {
+                std::clog << argv[0] << ": --coarse only takes 2 or 4, running at full resolution." << std::endl;
+            }
+            if (STRIPS) {
+                std::clog << argv[0] << ": Segmenting and cleaning up the masks in strips of " << STRIP_ROWS << " rows." << std::endl;
+            } else if (STRIP_ROWS > 0) {
+                std::clog << argv[0] << ": --strips has no effect with --cleanup=components, --packed-masks, --coarse or --scanlines." << std::endl;
+            }
+            if (SCANLINES != 0) {
+                std::clog << argv[0] << ": Detecting the cones on " << SCANLINES << " scanlines of the bird's-eye view." << std::endl;
+            }
+            if (TRACKING) {
+                std::clog << argv[0] << ": Tracking the cones, the whole ROI is segmented every " << TRACK_INTERVAL << " frames." << std::endl;
+            }
+            if (PIPELINE) {
+                std::clog << argv[0] << ": Running the acquisition, segmentation, geometry and control stages on separate threads." << std::endl;
+            }
+            if (REQUESTED_SKIP_BEHIND && replay) {
+                std::clog << argv[0] << ": Warning: --skip-behind has no effect with --replay, no frame of a recording is dropped." << std::endl;
+            } else if (REQUESTED_SKIP_BEHIND && !PIPELINE) {
+                std::clog << argv[0] << ": Warning: --skip-behind has no effect without --pipeline, the frame loop already waits for the newest frame." << std::endl;
+            }
+            //Writes the trace on SIGUSR2 instead of the thread that steers
+            std::unique_ptr<TraceWriter> traceWriter;
+            if (!TRACE_FILE.empty()) {
+                //Before the OD4 session is created, so that its callbacks already see tracing turned on
+                startTracing(TRACE_EVENTS_PER_THREAD);
+                nameTraceThread(PIPELINE ? "control" : "frame loop");
+                installTraceWriteSignal();
+                traceWriter.reset(new TraceWriter(TRACE_FILE, argv[0]));
+                std::clog << argv[0] << ": Tracing into " << TRACE_FILE << "; send SIGUSR2 to write it before the end." << std::endl;
+            }
+            std::string perfCounterError;
+            if (PERF_COUNTERS && startPerfCounters(perfCounterError)) {
+                std::clog << argv[0] << ": Counting the hardware events of every stage." << std::endl;
+            } else if (PERF_COUNTERS) {
+                //Usual in containers and VMs; perf_event_paranoid above 2 or a missing PMU
+                std::clog << argv[0] << ": --perf-counters has no effect, the hardware counters are not available (" << perfCounterError << ")." << std::endl;
+            }
+            if (STAGE_TIMING_ENABLED) {
+                installStageReportSignal();
+                std::clog << argv[0] << ": Recording stage latencies; send SIGUSR1 to print them." << std::endl;
+            }
+            if (VERIFY_SEGMENTATION && !FUSED_SEGMENTATION) {
+                std::clog << argv[0] << ": --verify-segmentation has no effect without --segmentation=fused." << std::endl;
+            }
+            if (CHECK_ALLOCATIONS && !ALLOCATION_COUNTER_ENABLED) {
+                std::clog << argv[0] << ": --check-allocations has no effect, rebuild with -D COUNT_ALLOCATIONS=ON." << std::endl;
+            } else if (CHECK_ALLOCATIONS && !ALLOCATION_FREE) {
+                std::clog << argv[0] << ": --check-allocations only reports the allocations of these options; use --segmentation=fused|lut"
+                          << " --packed-masks --cleanup=morphology --warp=centroids --centroids=components for frames that do not allocate." << std::endl;
+            }
+
+            //What each stage looks at of the command line
+            AcquisitionOptions acquisitionOptions;
+            acquisitionOptions.width = WIDTH;
+            acquisitionOptions.height = HEIGHT;
+            acquisitionOptions.fullFrame = FULL_FRAME;
+            acquisitionOptions.acquireRows = ACQUIRE_ROWS;
+            acquisitionOptions.reuseUnchanged = REUSE_UNCHANGED;
+
+            SegmentationOptions segmentationOptions;
+            segmentationOptions.program = argv[0];
+            segmentationOptions.fusedSegmentation = FUSED_SEGMENTATION;
+            segmentationOptions.lutSegmentation = LUT_SEGMENTATION;
+            segmentationOptions.kernel = KERNEL;
+            segmentationOptions.verifySegmentation = VERIFY_SEGMENTATION;
+            segmentationOptions.cleanup = CLEANUP;
+            segmentationOptions.packedSegmentation = PACKED_SEGMENTATION;
+            segmentationOptions.packedCleanup = PACKED_CLEANUP;
+            segmentationOptions.continuousSide = CONTINUOUS_SIDE;
+            segmentationOptions.scanlines = SCANLINES;
+            segmentationOptions.coarse = COARSE;
+            segmentationOptions.coarseStep = COARSE_STEP;
+            segmentationOptions.strips = STRIPS;
+            segmentationOptions.stripRows = STRIP_ROWS;
+            segmentationOptions.compareStrips = COMPARE_STRIPS;
+            segmentationOptions.trackInterval = TRACK_INTERVAL;
+            segmentationOptions.tracking = TRACKING;
+            segmentationOptions.parallelBranches = PARALLEL_BRANCHES;
+            segmentationOptions.blueRange = blueRange;
+            segmentationOptions.yellowRange = yellowRange;
+
+            GeometryOptions geometryOptions;
+            geometryOptions.program = argv[0];
+            geometryOptions.kernel = KERNEL;
+            geometryOptions.componentCentroids = COMPONENT_CENTROIDS;
+            geometryOptions.packedCleanup = PACKED_CLEANUP;
+            geometryOptions.scanlines = SCANLINES;
+            geometryOptions.coarse = COARSE;
+            geometryOptions.coarseStep = COARSE_STEP;
+            geometryOptions.compareCoarse = COMPARE_COARSE;
+            geometryOptions.compareWarp = COMPARE_WARP;
+            geometryOptions.tracking = TRACKING;
+            geometryOptions.warpCentroids = WARP_CENTROIDS;
+            geometryOptions.parallelBranches = PARALLEL_BRANCHES;
+            geometryOptions.blueRange = blueRange;
+            geometryOptions.yellowRange = yellowRange;
+
+            ControlOptions controlOptions;
+            controlOptions.program = argv[0];
+            controlOptions.replaying = static_cast<bool>(replay);
+            controlOptions.verbose = VERBOSE;
+            controlOptions.continuousSide = CONTINUOUS_SIDE;
+            controlOptions.scanlines = SCANLINES;
+            controlOptions.coarseStep = COARSE_STEP;
+            controlOptions.frameAge = FRAME_AGE;
+            controlOptions.checkAllocations = CHECK_ALLOCATIONS;
+            controlOptions.allocationFree = ALLOCATION_FREE;
+
+            ViewerOptions viewerOptions;
+            viewerOptions.width = WIDTH;
+            viewerOptions.height = HEIGHT;
+            //Sizes the reports of --replay and --compare-warp up front
+            const uint32_t expectedFrames{replay ? replay->frames() : 0};
+            //Set by the geometry stage when a track was lost, so that the segmentation stage does a detection next
+            std::atomic<bool> trackLost{false};
+
+            // The lookup table only depends on the HSV bounds, so the segmentation builds it once before the first frame.
+            SegmentationStage segmentation(segmentationOptions, trackLost);
+            if (LUT_SEGMENTATION) {
+                std::clog << argv[0] << ": Colour lookup table differs from the exact HSV test for " << segmentation.lutError() * 100.0 << "% of all BGR colours." << std::endl;
+            }
  
             // Interface to a running OpenDaVINCI session where network messages are exchanged.
             // The instance od4 allows you to send and receive messages.
-            cluon::OD4Session od4{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))};
+            // With --replay the messages come from the recording instead.
+            std::unique_ptr<cluon::OD4Session> od4{replay ? nullptr : new cluon::OD4Session{static_cast<uint16_t>(std::stoi(commandlineArguments["cid"]))}};
  
-            opendlv::proxy::GroundSteeringRequest gsr;
-            
-            std::mutex gsrMutex;
-            std::int32_t time;
-            std::int32_t sec;
+            //What the control stage reads of the messages
+            VehicleSignals signals;
            
-            auto onGroundSteeringRequest = [&gsr, &gsrMutex,&time, &grndSteerAngle,&sec](cluon::data::Envelope &&env){
+            auto onGroundSteeringRequest = [&signals](cluon::data::Envelope &&env){
                 // The  envelope data structure provide further details, such as sampleTimePoint as shown in this test case:
                 // https://github.com/chrberger/libcluon/blob/master/libcluon/testsuites/TestEnvelopeConverter.cpp#L31-L40
-                std::lock_guard<std::mutex> lck(gsrMutex);
-                gsr = cluon::extractMessage<opendlv::proxy::GroundSteeringRequest>(std::move(env));
+                nameTraceThread("od4");
+                TraceScope trace("GroundSteeringRequest");
+                std::lock_guard<std::mutex> lck(signals.gsrMutex);
+                TraceScope held("gsrMutex held");
+                signals.gsr = cluon::extractMessage<opendlv::proxy::GroundSteeringRequest>(std::move(env));
                 
                // std::cout << "lambda: groundSteering = " << gsr.groundSteering() << std::endl;
                 //std::cout<< "At timeStamp= "<< env.sampleTimeStamp().seconds()<< " the groundSteering angle is: "<<  grndSteerAngle <<" original: " << gsr.groundSteering()<<std::endl;
                 //std::cout<< env.sampleTimeStamp().seconds()<< " "<<  grndSteerAngle <<"; "<< gsr.groundSteering()<<std::endl;
-                sec= env.sampleTimeStamp().seconds();
-                time= env.sampleTimeStamp().microseconds();
+                signals.sec= env.sampleTimeStamp().seconds();
+                signals.time= env.sampleTimeStamp().microseconds();
             };
-            od4.dataTrigger(opendlv::proxy::GroundSteeringRequest::ID(),onGroundSteeringRequest);
+            if (od4) {
+                od4->dataTrigger(opendlv::proxy::GroundSteeringRequest::ID(),onGroundSteeringRequest);
+            }
             
-            dis; 
             opendlv::proxy::DistanceReading dr;
             std::mutex drMutex;
 
-            auto onDistanceReadingRequest=[&dr, &drMutex, &dis](cluon::data::Envelope &&env){
+            auto onDistanceReadingRequest=[&dr, &drMutex, &signals](cluon::data::Envelope &&env){
+                nameTraceThread("od4");
+                TraceScope trace("DistanceReading");
                 std::lock_guard<std::mutex> lck(drMutex);
+                TraceScope held("drMutex held");
                 
                 dr = cluon::extractMessage<opendlv::proxy::DistanceReading>(std::move(env));
                 //std::cout << "distance from the file = " << dr.distance() << std::endl;
-                dis= (dr.distance()/2)/29.1; 
+                signals.dis.store((dr.distance()/2)/29.1);
                 //dis = dr.distance();
                 //std::cout << "actual distance = " << dis << " at this timeStamp: "<< env.sampleTimeStamp().seconds()<< std::endl;
 
             };
 
-            od4.dataTrigger(opendlv::proxy::DistanceReading::ID(),onDistanceReadingRequest);
-            
-            
-            // Endless loop; end the program by pressing Ctrl-C.
-            while (od4.isRunning()) {
-                // OpenCV data structure to hold an image.
-                //cv::Mat img;
- 
-                // Wait for a notification of a new frame.
-                sharedMemory->wait();
- 
-                // Lock the shared memory.
-                sharedMemory->lock();
-                {
-                    // Copy the pixels from the shared memory into our own data structure.
-                    cv::Mat wrapped(HEIGHT, WIDTH, CV_8UC4, sharedMemory->data());
-                    img = wrapped.clone();
+            if (od4) {
+                od4->dataTrigger(opendlv::proxy::DistanceReading::ID(),onDistanceReadingRequest);
+            }
+            auto onReplayedMessage = [&](cluon::data::Envelope &&env) {
+                if (env.dataType() == opendlv::proxy::GroundSteeringRequest::ID()) {
+                    onGroundSteeringRequest(std::move(env));
+                } else if (env.dataType() == opendlv::proxy::DistanceReading::ID()) {
+                    onDistanceReadingRequest(std::move(env));
                 }
-                // TODO: Here, you can add some code to check the sampleTimePoint when the current frame was captured.
-                
-                
-                /*
-                cluon::data::TimeStamp tid= cluon::time::now();
-                int64_t na= cluon::time::toMicroseconds(tid);
-                std::cout << "the timeStamps"<< na<< endl;
-                */
-                sharedMemory->unlock();
- 
-                // TODO: Do something with the frame.
-                // Example: Draw a red rectangle and display image.
-                //cv::rectangle(img, cv::Point(50, 50), cv::Point(100, 100), cv::Scalar(0,0,255));
- 
-                using namespace std;
-                //using namespace cv;
-
-                cv::Mat hsv;
-
-                cv::Mat blueConesOpen;
-                cv::Mat blueConesClose;
-
-                cv:: Mat yellowConesOpen;
-                cv:: Mat yellowConesClose;
-
-                Mat imgCopyBlue = img.clone();
-                Mat imgCopyYellow = img.clone();
-
-                
-                blueCones= applyFilter(imgCopyBlue, 42, 99, 44, 155, 200, 79);
-                yellowCones= applyFilter(imgCopyYellow, yMinHue, yMinSat, yMinVal, yMaxHue, yMaxSat, yMaxVal);
-               
-
-                //Opening and closing are used for getting rid of noise
-
-                blueConesClose = reduceNoise(blueCones);
-                yellowConesClose = reduceNoise(yellowCones);
-                            
-                makeTrackbar(img, WIDTH, HEIGHT);
-                Mat warpedImgBlue;
-                Mat warpedImgYellow;
-                Mat warpedImgCombined;               
-
-                //Both the blue and the yellow cones are givven a gaussian blur, dilated, and put through the canny method
-                //Canny detects the edges of a given imag
-
-                
-                vector <Point2f> src_1[6000];
+            };
+            auto sessionRunning = [&]() {
+                return !od4 || od4->isRunning();
+            };
             
-                warpedImgBlue = applyWarp(blueConesClose);
-                warpedImgYellow = applyWarp(yellowConesClose);
-
-                Mat cannyImage; 
-                warpedImgCombined= warpedImgBlue + warpedImgYellow; 
-                //Canny(warpedImgCombined, cannyImage, 127,255,3);
-
-                //This combines the warped images for the blue and yellow cones.
-                //warpedImgCombined = warpedImgBlue + warpedImgYellow; 
-                RNG rng(12345);                
-                Scalar color= Scalar(rng.uniform(0,225), rng.uniform(0,255), rng.uniform(0,255));            
-                vector<vector<Point> > contoursB;
-                vector<vector<Point> > contoursY;
-                findContours(warpedImgBlue, contoursB, RETR_TREE,CHAIN_APPROX_SIMPLE); 
-                findContours(warpedImgYellow, contoursY, RETR_TREE,CHAIN_APPROX_SIMPLE); 
-
-                std::vector<cv::Point2f> mcB = findCoordinates(contoursB);
-                std::vector<cv::Point2f> mcY = findCoordinates(contoursY);
-
-                Mat drawing= Mat::zeros(warpedImgCombined.size(), CV_8UC3);
-                //Mat drawing = warpedImgCombined.clone();
-                Point lineStart = Point(320, 350);
-                
-                unsigned int len = 0;
-                
-                if(coneDecider==0){
-                    checkSide(warpedImgBlue);
-                }
-
-                if(contoursB.size()>0 && contoursY.size() > 0){ 
-                    if(mcB[0].y<350 && mcY[0].y<350) {   
-                        double midpointX = (mcB[0].x + mcY[0].x)/2;
-                        double midpointY = (mcB[0].y + mcY[0].y)/2;
+            // Hands the frames from the control stage to the viewer thread with --verbose. The buffers are sized up
+            // front, so handing a frame over does not allocate.
+            LatestValue<ViewerFrame> viewerFrames;
+            for (int i = 0; i < 3; i++) {
+                viewerFrames.slot(i).image.create(HEIGHT, WIDTH, CV_8UC4);
+            }
+            std::atomic<bool> viewerRunning{true};
 
-                        Point2f midpoint = Point2f(midpointX, midpointY);
+            // The work on one frame is split into four stages that only share the FrameBuffers of that frame.
+            // Without --pipeline they run one after the other on this thread, which keeps replays deterministic.
+            AcquisitionStage acquisition(acquisitionOptions, replay.get(), sharedMemory.get(), signals);
+            GeometryStage geometry(geometryOptions, trackLost, expectedFrames);
+            ControlStage control(controlOptions, signals, viewerFrames, expectedFrames);
+            FrameViewer viewer(viewerOptions, windowName, viewerFrames, viewerRunning);
 
-                        double oppLength = 320 - midpoint.x;
-                        double adLength = 450 - midpoint.y;
+            bool allocationCheckFailed{false};
+            publishWarpQuad(sliderWarpQuad());
+            const std::chrono::steady_clock::time_point loopStart = std::chrono::steady_clock::now();
+            std::thread viewerThread;
+            if (VERBOSE) {
+                viewerThread = std::thread(&FrameViewer::run, &viewer);
+            }
+            if (PIPELINE) {
+                // Every stage runs on its own thread, so the frame rate is set by the slowest stage.
+                // Only PIPELINE_SLOTS frames are in flight; the queues can hold all of them, so a push between
+                // stages never fails and frames are only dropped at the acquisition when no buffers are free.
+                std::atomic<bool> running{true};
+                FrameBuffers slots[PIPELINE_SLOTS];
+                SpscQueue<FrameBuffers *, PIPELINE_SLOTS> freeSlots;
+                SpscQueue<FrameBuffers *, PIPELINE_SLOTS> segmentQueue;
+                SpscQueue<FrameBuffers *, PIPELINE_SLOTS> geometryQueue;
+                SpscQueue<FrameBuffers *, PIPELINE_SLOTS> controlQueue;
+                PipelineBacklog backlog(PIPELINE_SLOTS);
+                for (FrameBuffers &buffers : slots) {
+                    buffers.image.create(HEIGHT, WIDTH, CV_8UC4);
+                    buffers.image.setTo(Scalar::all(0));
+                    freeSlots.push(&buffers);
+                }
 
-                        double midpointRadian = calculateInverse(adLength, oppLength);
-                        double midpointRadian2 = midpointRadian -(midpointRadian/2);
+                auto printPipelineStats = [&]() {
+                    std::clog << argv[0] << ": queue depth/max/drops: segment " << segmentQueue.depth() << "/" << segmentQueue.maxDepth() << "/" << segmentQueue.drops()
+                              << ", geometry " << geometryQueue.depth() << "/" << geometryQueue.maxDepth() << "/" << geometryQueue.drops()
+                              << ", control " << controlQueue.depth() << "/" << controlQueue.maxDepth() << "/" << controlQueue.drops() << std::endl;
+                };
 
-                        if(dis > 0.03){
-                            grndSteerAngle = 0;
-                        }else{ 
-                            if(midpointRadian2 > 0.4 || midpointRadian2 <-0.4){
-                                grndSteerAngle = midpointRadian2 - (midpointRadian2/1.25);
-                            }
-                            else{
-                                grndSteerAngle = midpointRadian2; 
-                            }                  
+                std::thread acquireThread([&]() {
+                    nameTraceThread("acquisition");
+                    while (running.load() && sessionRunning()) {
+                        // Wait for a notification of a new frame.
+                        if (!acquisition.wait(onReplayedMessage)) {
+                            break;
                         }
-                        line(drawing, lineStart, midpoint, color, 5);
-                        line(drawing, lineStart, Point(320, midpoint.y), Scalar(0,255,0), 5);
-                        line(drawing, midpoint, Point(320, midpoint.y), Scalar(0,0,255), 5);
-                    }
-               } else if(contoursB.size()>0){
-                        len = 0;   
-                     if(mcB[len].y < 350){
-                        len = contoursB.size()-1;
-                        double cLength;
-                        //circle(warpedImgCombined,mcB[len],4,color,-1,8,0);
-                         if(conesLeft){
-                              cLength = 320 - mcB[len].x;
-                            }else{
-                                cLength=mcB[len].x-320;
+                        FrameBuffers *buffers;
+                        if (!running.load()) {
+                            break;
+                        }
+                        if (replay) {
+                            //No frame of a recording is skipped, the acquisition waits for free buffers instead
+                            while (!freeSlots.pop(buffers) && running.load()) {
+                                std::this_thread::yield();
                             }
-                        double bLength = 450 - mcB[len].y;
-                        double radian {calculateInverse(bLength,cLength)};
-                        double angle {calculateAngle(radian)};
-                        double radian2 = radian - (radian/2);
-
-                        if(dis >0.03){
-                            grndSteerAngle = 0;
-                        }else{
-                            if(radian2 > 0.4 || radian2 <-0.4){
-                                grndSteerAngle = radian2 - (radian2/1.25);
+                            if (!running.load()) {
+                                break;
                             }
-                            else{
-                                grndSteerAngle = radian - (radian/ 2);
+                        } else {
+                            if (SKIP_BEHIND && backlog.behind(cluon::time::toMicroseconds(cluon::time::now()), acquisition.producerPeriod())) {
+                                //The producer has already replaced the frame the stages are working on; this one would
+                                //only wait behind it
+                                segmentQueue.recordDrop();
+                                continue;
                             }
-                            
-                        }                     
-                            line(drawing, lineStart, mcB[len], color, 5);
-                            line(drawing, lineStart, Point(320, mcB[len].y), Scalar(0,255,0), 5);
-                            line(drawing, mcB[len], Point(320, mcB[len].y), Scalar(0,0,255), 5);
-                       }
-                   }
-
-                 
-                
+                            if (!freeSlots.pop(buffers)) {
+                                //All buffers are still in the pipeline; the frame is skipped instead of holding up the producer
+                                segmentQueue.recordDrop();
+                                continue;
+                            }
+                        }
+                        acquisition.run(*buffers);
+                        backlog.enter(buffers->acquireTime);
+                        segmentQueue.push(buffers);
+                    }
+                    //Lets the stages finish the last frames of the recording
+                    while (replay && running.load() && freeSlots.depth() != PIPELINE_SLOTS) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    running.store(false);
+                });
+                std::thread segmentThread([&]() {
+                    nameTraceThread("segmentation");
+                    FrameBuffers *buffers;
+                    while (segmentQueue.waitPop(buffers, running)) {
+                        segmentation.run(*buffers);
+                        geometryQueue.push(buffers);
+                    }
+                });
+                std::thread geometryThread([&]() {
+                    nameTraceThread("geometry");
+                    FrameBuffers *buffers;
+                    while (geometryQueue.waitPop(buffers, running)) {
+                        geometry.run(*buffers);
+                        controlQueue.push(buffers);
+                    }
+                });
 
-                // If you want to access the latest received ground steering, don't forget to lock the mutex:
+                // The control stage runs on the main thread.
+                FrameBuffers *buffers;
+                while (controlQueue.waitPop(buffers, running)) {
+                    const bool passed = control.run(*buffers);
+                    const uint32_t frameNumber = buffers->frameNumber;
+                    //Before the buffers can be taken for the next frame, so that no more than PIPELINE_SLOTS frames are in it
+                    backlog.leave();
+                    freeSlots.push(buffers);
+                    if (!passed) {
+                        allocationCheckFailed = true;
+                        break;
+                    }
+                    if (VERBOSE && (frameNumber % PIPELINE_STATS_INTERVAL == 0)) {
+                        printPipelineStats();
+                    }
+                }
+                running.store(false);
+                // Wakes the acquisition thread in case it is still waiting for a frame.
+                if (sharedMemory) {
+                    sharedMemory->notifyAll();
+                }
+                acquireThread.join();
+                segmentThread.join();
+                geometryThread.join();
+                printPipelineStats();
+            }
+            else {
+                FrameBuffers buffers;
+                buffers.image.create(HEIGHT, WIDTH, CV_8UC4);
+                buffers.image.setTo(Scalar::all(0));
 
-                {
-                    
-                std::lock_guard<std::mutex> lck(gsrMutex);
-                string angleResults = "ours: "+ std::to_string(grndSteerAngle) + " original: " + std::to_string(gsr.groundSteering());
-                putText(img, angleResults , Point(5, 200), cv::FONT_HERSHEY_DUPLEX, 1.0, CV_RGB(118, 185, 0), 2);
-                std::cout <<"group_06;"<<sec<<time<<";"<<grndSteerAngle<<std::endl;
-                    
+                // Endless loop; end the program by pressing Ctrl-C.
+                while (sessionRunning()) {
+                    // Wait for a notification of a new frame.
+                    if (!acquisition.wait(onReplayedMessage)) {
+                        break;
+                    }
+                    acquisition.run(buffers);
+                    segmentation.run(buffers);
+                    geometry.run(buffers);
+                    if (!control.run(buffers)) {
+                        allocationCheckFailed = true;
+                        break;
+                    }
                 }
-                coneDecider++;
-                
-                // Display image on your screen.
-                if (VERBOSE) {
-                    cv::imshow(sharedMemory->name().c_str(), img);
-                    
-                    //cv::imshow("with rect", drawing);
-                    cv::imshow("cones", drawing);
-                    //cv::imshow("yellow cones", yellowCones);
-                    //cv::imshow("blue cones", blueCones);
-                    //cv::imshow("with g blurr", gBlurredImg);
-                    //cv::imshow("with dilation", dilatedImg);
-                    //cv::imshow("with dilation and canny", cannyDilateYellow);
-
-                    cv::waitKey(1);
+            }
+            const double loopSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loopStart).count();
+            if (viewerThread.joinable()) {
+                viewerRunning.store(false);
+                viewerThread.join();
+            }
+            if (replay) {
+                if (!replay->valid()) {
+                    std::clog << argv[0] << ": " << replay->error() << "." << std::endl;
+                }
+                std::clog << argv[0] << ": ";
+                printReplayBenchmark(control.replayLatencies(), loopSeconds, replay->decodeSeconds(), std::clog);
+                std::clog << std::endl;
+            }
+            std::clog << argv[0] << ": ";
+            printFrameCounts(acquisition.counts(), std::clog);
+            std::clog << std::endl;
+            if (control.frameAges().frames > 0) {
+                std::clog << argv[0] << ": ";
+                printFrameAges(control.frameAges(), std::clog);
+                std::clog << std::endl;
+            }
+            printStageLatencies(std::clog);
+            if (PERF_COUNTERS) {
+                printPerfCounters(std::clog);
+            }
+            if (!TRACE_FILE.empty()) {
+                //Stopped first, so that it cannot write the same file at the same time
+                traceWriter.reset();
+                if (writeTrace(TRACE_FILE)) {
+                    std::clog << argv[0] << ": Wrote the trace into " << TRACE_FILE << "." << std::endl;
+                } else {
+                    std::clog << argv[0] << ": Could not write the trace into " << TRACE_FILE << "." << std::endl;
                 }
             }
+            if (COMPARE_COARSE) {
+                std::clog << argv[0] << ": ";
+                printCoarseComparison(geometry.coarseComparison(), COARSE_STEP, std::clog);
+                std::clog << std::endl;
+            }
+            if (COMPARE_STRIPS) {
+                std::clog << argv[0] << ": ";
+                printStripComparison(segmentation.stripComparison(), STRIP_ROWS, std::clog);
+                std::clog << std::endl;
+            }
+            if (COMPARE_WARP) {
+                std::clog << argv[0] << ": ";
+                printWarpComparison(geometry.warpComparison(), std::clog);
+                std::clog << std::endl;
+            }
+            if (VERIFY_SEGMENTATION && FUSED_SEGMENTATION) {
+                std::clog << argv[0] << ": " << segmentationKernelName(KERNEL) << " kernel checked on " << segmentation.verifiedFrames() << " frames, "
+                          << segmentation.segmentationMismatches() << " mask pixels differ from the scalar reference." << std::endl;
+            }
+            //A recording that could not be decoded to the end fails as well, so that a broken replay does not go unnoticed
+            retCode = (allocationCheckFailed || segmentation.segmentationMismatches() != 0 || (replay && !replay->valid())) ? 1 : 0;
+        }
+        else {
+            retCode = 0;
         }
-        retCode = 0;
     }
     return retCode;
 }
 
-Mat applyFilter(Mat image, int minHue, int minSat, int minVal, int maxHue, int maxSat, int maxVal){
-    Mat hsv;
-    Mat filteredCones;
+//hsv and filteredCones are outputs so that the caller can keep them between frames
+void applyFilter(const Mat &image, int minHue, int minSat, int minVal, int maxHue, int maxSat, int maxVal, Mat &hsv, Mat &filteredCones){
     cvtColor(image,hsv,COLOR_BGR2HSV); 
     inRange(hsv, Scalar(minHue,minSat,minVal),Scalar(maxHue,maxSat,maxVal), filteredCones);
-    
-    return filteredCones;
 }
 
-Mat reduceNoise(Mat image){
-    Mat imgOpen;
-    Mat imgClose;
-    Mat gBlurredImg;
-    Mat dilatedImg;
-    Mat cannyImg;
-
+void reduceNoise(const Mat &image, Mat &gBlurredImg, Mat &cannyImg){
     //cv::Mat Kernel = cv::Mat(cv::Size(5,5),CV_8UC1,cv::Scalar(255));
     //cv::morphologyEx(image, imgOpen,cv::MORPH_OPEN,Kernel);
     //cv::morphologyEx(imgOpen, imgClose,cv::MORPH_CLOSE,Kernel); 
     
+    //The result of the dilation that used to follow the blur was never used, so it is not computed anymore
     GaussianBlur(image,gBlurredImg,Size(5,5),0);
-    dilate(gBlurredImg, dilatedImg, Mat(), Point(-1, -1), 2, 1, 1); 
     Canny(gBlurredImg, cannyImg, 127,255,3);
-
-
-
-    return cannyImg;
-
 }
 
 double calculateInverse(double bLength, double cLength){
@@ -372,12 +680,32 @@ double calculateAngle(double inverse){
     return angle;
 }
 
-Mat applyWarp(Mat image){
-    Mat warpedImg;
-    Mat matrix; 
+void applyWarp(const Mat &image, const WarpQuad &quad, Mat &warpedImg){
+    StageTimer timer;
+    prepareWarp(quad, image.size());
+    //Same result as warpPerspective(image, warpedImg, matrix, image.size()) without the per-pixel projective divide
+    remap(image, warpedImg, warpCache.map1, warpCache.map2, INTER_LINEAR, BORDER_CONSTANT);
+    timer.stop(Stage::Warp);
+}
+
+//Makes sure that the warp cache holds the homography and the remap tables of quad.
+//Once it has been called for a quad and size, applyWarp() and warpCoordinates() only read the cache.
+void prepareWarp(const WarpQuad &quad, Size size){
+    getWarpMatrix(quad);  //Refreshes the cache and drops the maps if a slider has moved
+    if(warpCache.map1.empty() || warpCache.map1.size() != size){
+        buildWarpMaps(size);
+    }
+}
+
+//Returns the homography from the camera image into the bird's-eye view.
+//It is only recomputed when the quad has changed since the last call.
+Mat getWarpMatrix(const WarpQuad &quad){
+    if(warpCache.valid && warpCache.quad.xLeft == quad.xLeft && warpCache.quad.xRight == quad.xRight && warpCache.quad.y == quad.y){
+        return warpCache.matrix;
+    }
     std::vector <Point2f> pts1;
-    pts1.push_back(Point2f(slider_x_left, slider_y));  //The x and y coordinates of the top two points can be adjusted with the
-    pts1.push_back (Point2f(slider_x_right, slider_y)); //track bar
+    pts1.push_back(Point2f(quad.xLeft, quad.y));  //The x and y coordinates of the top two points can be adjusted with the
+    pts1.push_back (Point2f(quad.xRight, quad.y)); //track bar
     pts1.push_back(Point2f(0, 386));
     pts1.push_back (Point2f(632, 386));
 
@@ -387,35 +715,129 @@ Mat applyWarp(Mat image){
     pts2.push_back(Point2f(0,480));
     pts2.push_back(Point2f(640,480));
 
-    matrix = getPerspectiveTransform(pts1,pts2);
-    warpPerspective(image, warpedImg, matrix, img.size());
-    return warpedImg;
+    warpCache.matrix = getPerspectiveTransform(pts1,pts2);
+    warpCache.quad = quad;
+    warpCache.map1.release();
+    warpCache.map2.release();
+    warpCache.valid = true;
+    return warpCache.matrix;
 }
-using namespace cv;
-using namespace std;
 
-std::vector<cv::Point2f> findCoordinates(std::vector<std::vector<cv::Point> > contours){
-    std::vector<std::vector<cv::Point> > contour_polyB(contours.size() );
-    std::vector<Rect> boundRectB( contours.size() );
-    std::vector<Moments> muB (contours.size());
-    std::vector<cv::Point2f> mc (contours.size());
+//Precomputes the fixed-point maps that warpPerspective() would compute for every call.
+//The arithmetic follows the WarpPerspectiveInvoker of OpenCV 3.2, the version of the Docker image (double precision,
+//5 fractional bits). Newer versions interpolate warpPerspective() differently; --compare-warp counts the pixels
+//in which remap() with these maps and warpPerspective() differ on the OpenCV the service runs with.
+void buildWarpMaps(Size size){
+    const int INTER_BITS = 5;
+    const int INTER_TAB_SIZE = 1 << INTER_BITS;
+    Mat inverse;
+    invert(warpCache.matrix, inverse);
+    const double *m = inverse.ptr<double>();
 
-    for(size_t i=0; i<contours.size();i++){
-            muB[i]= moments(contours[i], false);
-            approxPolyDP(contours[i], contour_polyB[i], 3, true); 
-            boundRectB[i]= boundingRect(contour_polyB[i]);
+    warpCache.map1.create(size, CV_16SC2);
+    warpCache.map2.create(size, CV_16UC1);
+    for(int y=0; y<size.height; y++){
+        short *xy = warpCache.map1.ptr<short>(y);
+        ushort *table = warpCache.map2.ptr<ushort>(y);
+        const double X0 = m[1]*y + m[2];
+        const double Y0 = m[4]*y + m[5];
+        const double W0 = m[7]*y + m[8];
+        for(int x=0; x<size.width; x++){
+            double W = W0 + m[6]*x;
+            W = (W > 0.0 || W < 0.0) ? INTER_TAB_SIZE/W : 0.0;
+            const double fX = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (X0 + m[0]*x)*W));
+            const double fY = std::max(static_cast<double>(INT_MIN), std::min(static_cast<double>(INT_MAX), (Y0 + m[3]*x)*W));
+            const int X = saturate_cast<int>(fX);
+            const int Y = saturate_cast<int>(fY);
+            xy[x*2] = saturate_cast<short>(X >> INTER_BITS);
+            xy[x*2+1] = saturate_cast<short>(Y >> INTER_BITS);
+            table[x] = static_cast<ushort>((Y & (INTER_TAB_SIZE-1))*INTER_TAB_SIZE + (X & (INTER_TAB_SIZE-1)));
+        }
     }
+}
+
+//The bird's-eye view only samples the quad pts1 of getWarpMatrix(), so everything above the horizon (quad.y)
+//and below the hood (row 386) is cut away. Only rows are cut: the bottom edge of the quad spans x=0 to x=632, which
+//with the halo is the whole width of the frame. The ROI follows the sliders since it is computed for every frame.
+//--compare-warp counts the pixels in which the bird's-eye view of the ROI differs from the one of the whole frame.
+Rect getWarpSourceRoi(Size size, const WarpQuad &quad){
+    const int top = std::min(quad.y, 386) - ROI_HALO;
+    const int bottom = std::max(quad.y, 386) + 1 + ROI_HALO;
+    return Rect(0, top, size.width, bottom - top) & Rect(0, 0, size.width, size.height);
+}
 
-    //mcB.resize(contours.size());
-    for(size_t i=0; i< contours.size();i++){
-            mc[i]= Point2f(muB[i].m10/muB[i].m00, muB[i].m01/muB[i].m00);
-     }
+//Only called on the thread that runs the GUI
+WarpQuad sliderWarpQuad(){
+    return WarpQuad{slider_x_left, slider_x_right, slider_y};
+}
+
+//The trackbars keep every slider within 0..alpha_slider_max, so each one fits into 16 bits
+void publishWarpQuad(const WarpQuad &quad){
+    publishedQuad.store(static_cast<uint64_t>(quad.xLeft & 0xFFFF) | (static_cast<uint64_t>(quad.xRight & 0xFFFF) << 16) | (static_cast<uint64_t>(quad.y & 0xFFFF) << 32));
+}
 
-     return mc;     
+WarpQuad publishedWarpQuad(){
+    const uint64_t packed = publishedQuad.load();
+    return WarpQuad{static_cast<int>(packed & 0xFFFF), static_cast<int>((packed >> 16) & 0xFFFF), static_cast<int>((packed >> 32) & 0xFFFF)};
 }
 
-static void makeTrackbar(Mat image, int WIDTH, int HEIGHT){
-        slider_dst = image.clone();
+//Puts a mask that was computed on the ROI back into an empty frame of the full size
+void placeInFrame(const Mat &roiImage, Rect roi, Size size, Mat &frame){
+    frame.create(size, roiImage.type());
+    if(roiImage.size() != size){
+        frame.setTo(Scalar::all(0));
+    }
+    Mat target = frame(roi);
+    roiImage.copyTo(target);
+}
+
+//Moves centroids found in the camera image into the bird's-eye view of applyWarp().
+//Centroids of degenerate contours (NaN) and centroids that land outside of the warped image are dropped,
+//since applyWarp() crops those cones away as well. The order of the remaining points is kept.
+//The centroid of a warped blob is not exactly the warped centroid and the warp can split or merge Canny edges
+//differently, so the cones are not exactly where --warp=image finds them; --compare-warp reports how far apart they are.
+//points and warped may be the same vector; it is compacted in place, so no memory is allocated once it has grown.
+void warpCoordinates(const std::vector<cv::Point2f> &points, const WarpQuad &quad, Size size, std::vector<cv::Point2f> &warped){
+    size_t count = 0;
+    if(&warped != &points){
+        warped.resize(points.size());
+    }
+    for(size_t i=0; i<points.size(); i++){
+        if(!std::isnan(points[i].x) && !std::isnan(points[i].y)){
+            warped[count++] = points[i];
+        }
+    }
+    warped.resize(count);
+    if(warped.empty()){
+        return;
+    }
+    StageTimer timer;
+    perspectiveTransform(warped, warped, getWarpMatrix(quad));
+    timer.stop(Stage::Warp);
+
+    count = 0;
+    for(size_t i=0; i<warped.size(); i++){
+        if(warped[i].x >= 0 && warped[i].x < size.width && warped[i].y >= 0 && warped[i].y < size.height){
+            warped[count++] = warped[i];
+        }
+    }
+    warped.resize(count);
+}
+using namespace cv;
+using namespace std;
+
+//Only the moment centroids are used by the steering; the polygon approximation and bounding boxes
+//that used to be computed here were never read and are left out.
+void findCoordinates(const std::vector<std::vector<cv::Point> > &contours, std::vector<cv::Point2f> &mc){
+    mc.resize(contours.size());
+    for(size_t i=0; i<contours.size();i++){
+            Moments muB = moments(contours[i], false);
+            mc[i]= Point2f(muB.m10/muB.m00, muB.m01/muB.m00);
+    }
+}
+
+//Opens the slider window once; OpenCV writes the slider positions into slider_x_left, slider_x_right and slider_y
+void makeTrackbar(int WIDTH, int HEIGHT){
         namedWindow("Linear Blend", WINDOW_AUTOSIZE);  //This is the window that the track bar will be displayed in
         char TrackbarName[50];  //Each trackbar has a name
         char TrackbarName2[50];
@@ -429,13 +851,19 @@ static void makeTrackbar(Mat image, int WIDTH, int HEIGHT){
         createTrackbar( TrackbarName, "Linear Blend", &slider_x_left, alpha_slider_max, on_trackbar );
         createTrackbar( TrackbarName2, "Linear Blend", &slider_x_right, alpha_slider_max, on_trackbar );
         createTrackbar( TrackbarName3, "Linear Blend", &slider_y, alpha_slider_max, on_trackbar );
-        //these are the methods that are called when the trackbar is moved.
+}
+
+//Shows the current frame in the slider window with the corners of the quad on it
+void showTrackbar(const Mat &image){
+        image.copyTo(slider_dst);
         on_trackbar( slider_x_left, 0 );
-        on_trackbar( slider_y, 0 );
-        on_trackbar( slider_x_right, 0 );
 }
 
 static void on_trackbar( int, void* ){
+   //A slider can be moved before the first frame has arrived
+   if(slider_dst.empty()){
+       return;
+   }
    cv::Point left = cv::Point(slider_x_left, slider_y);
    cv::Point right = cv::Point(slider_x_right, slider_y);
    cv::Scalar color= cv::Scalar(255,0,0);
@@ -455,15 +883,168 @@ bool checkSide(Mat image){
     right=image(rightPart);
     count= cv::countNonZero(left);
     count2= cv::countNonZero(right);
-    if(count<count2){
-        //std::cout<<"cone are right"<<std::endl;
-        conesLeft=false;
-    }else{
-        conesLeft=true;
-        //std::cout<<"cones are left"<<std::endl;
+    //std::cout<<(count<count2 ? "cone are right" : "cones are left")<<std::endl;
+    return !(count<count2);
+
+}
+
+//Column of the camera image that the centre line x=320 of the bird's-eye view runs through. The top and the
+//bottom edge of the quad are horizontal, so the warp maps the midpoints of both edges onto the centre line;
+//with the default sliders it only moves from x=300 to x=316 between them, so their average is used.
+int sideSplitColumn(const WarpQuad &quad){
+    return ((quad.xLeft + quad.xRight) / 2 + 316) / 2;
+}
+
+//Continuous replacement for checkSide(), from the blue pixels per column of the camera image.
+//Unlike checkSide() it counts in camera space, so close cones weigh more than in the bird's-eye view.
+bool updateSide(const std::vector<int> &columns, int split, SideTracker &tracker){
+    long left = 0;
+    long right = 0;
+    for(size_t i=0; i<columns.size(); i++){
+        if(static_cast<int>(i) < split){
+            left += columns[i];
+        }else{
+            right += columns[i];
+        }
     }
-    
-    return conesLeft;
+    if(!tracker.initialised){
+        tracker.left = !(left<right);
+        tracker.initialised = true;
+        return tracker.left;
+    }
+    const bool otherSideWins = tracker.left ? (right > left * SIDE_HYSTERESIS) : (left > right * SIDE_HYSTERESIS);
+    tracker.pendingFrames = otherSideWins ? tracker.pendingFrames + 1 : 0;
+    if(tracker.pendingFrames >= SIDE_SWITCH_FRAMES){
+        tracker.left = !tracker.left;
+        tracker.pendingFrames = 0;
+    }
+    return tracker.left;
+}
 
+//Matches every full-resolution centroid to the closest coarse one. findCoordinates() gives each Canny outline
+//an outer and an inner contour, so one coarse blob usually matches two of them.
+void compareCentroids(const std::vector<ConeBlob> &coarse, const std::vector<cv::Point2f> &reference, CoarseComparison &comparison){
+    for(const Point2f &point : reference){
+        //Contours without area have no centroid
+        if(!std::isfinite(point.x) || !std::isfinite(point.y)){
+            continue;
+        }
+        float closest = COARSE_MATCH_DISTANCE;
+        bool found = false;
+        for(const ConeBlob &blob : coarse){
+            const float distance = static_cast<float>(norm(blob.centroid - point));
+            if(distance <= closest){
+                closest = distance;
+                found = true;
+            }
+        }
+        if(found){
+            comparison.matched++;
+            comparison.error += closest;
+        }else{
+            comparison.missed++;
+        }
+    }
+    for(const ConeBlob &blob : coarse){
+        bool found = false;
+        for(const Point2f &point : reference){
+            found = found || (norm(blob.centroid - point) <= COARSE_MATCH_DISTANCE);
+        }
+        comparison.extra += found ? 0 : 1;
+    }
+}
+
+void printCoarseComparison(const CoarseComparison &comparison, int step, std::ostream &out){
+    const double frames = (comparison.frames > 0) ? static_cast<double>(comparison.frames) : 1.0;
+    out << "coarse x" << step << " over " << comparison.frames << " frames: " << comparison.matched << " of "
+        << (comparison.matched + comparison.missed) << " full-resolution centroids found, mean error "
+        << ((comparison.matched > 0) ? comparison.error / static_cast<double>(comparison.matched) : 0.0) << " px, "
+        << comparison.extra << " extra; " << comparison.coarseSeconds * 1000.0 / frames << " ms/frame against "
+        << comparison.referenceSeconds * 1000.0 / frames << " ms/frame at full resolution";
+}
+
+void printFrameCounts(const FrameCounts &counts, std::ostream &out){
+    out << counts.acquired << " frames acquired, " << counts.unchanged << " reused as unchanged, " << counts.stopped
+        << " reused while standing still, " << (counts.acquired - counts.unchanged - counts.stopped) << " processed; "
+        << counts.dropped << " frames of the producer were not acquired";
+}
+
+void printFrameAges(const FrameAges &ages, std::ostream &out){
+    const double frames = (ages.frames > 0) ? static_cast<double>(ages.frames) : 1.0;
+    out << "age of " << ages.frames << " frames since they were sampled: acquired after " << ages.acquiredSum / frames
+        << " us on average and " << ages.acquiredMax << " us at most, steered after " << ages.decidedSum / frames
+        << " us on average and " << ages.decidedMax << " us at most";
+}
+
+void printReplayBenchmark(std::vector<int64_t> &latencies, double seconds, double decodeSeconds, std::ostream &out){
+    std::sort(latencies.begin(), latencies.end());
+    const double frames = static_cast<double>(latencies.size());
+    out << "replayed " << latencies.size() << " frames in " << seconds << " s: " << ((seconds > 0.0) ? frames / seconds : 0.0)
+        << " frames/s, " << ((seconds > decodeSeconds) ? frames / (seconds - decodeSeconds) : 0.0) << " frames/s without the "
+        << decodeSeconds << " s of decoding";
+    if (!latencies.empty()) {
+        const size_t last = latencies.size() - 1;
+        out << "; latency from the acquisition to the steering in us: p50 " << latencies[last / 2] << " p99 "
+            << latencies[last * 99 / 100] << " max " << latencies[last];
+    }
 }
 
+//The default chain of the service (fused segmentation, Canny, image warp) on the whole frame, with the plain
+//OpenCV calls next to the shortcuts of applyWarp(), the same chain on the rows of the ROI, and the first cone
+//of each colour, which the steering takes, from the image warp and from the warped centroids
+void compareWarp(const Mat &image, const WarpQuad &quad, const HsvRange &blueRange, const HsvRange &yellowRange,
+                 SegmentationKernel kernel, WarpReference (&references)[2], WarpComparison &comparison){
+    const Size size = image.size();
+    const Rect roi = getWarpSourceRoi(size, quad);
+    segmentConesFused(image, blueRange, yellowRange, references[0].mask, references[1].mask, kernel);
+    segmentConesFused(image(roi), blueRange, yellowRange, references[0].roiMask, references[1].roiMask, kernel);
+    for(WarpReference &reference : references){
+        reduceNoise(reference.mask, reference.blurred, reference.cleaned);
+        applyWarp(reference.cleaned, quad, reference.warped);
+        warpPerspective(reference.cleaned, reference.perspective, getWarpMatrix(quad), size);
+        comparison.remapMismatches += static_cast<uint64_t>(countNonZero(reference.warped != reference.perspective));
+
+        reduceNoise(reference.roiMask, reference.blurred, reference.roiCleaned);
+        placeInFrame(reference.roiCleaned, roi, size, reference.roiFramed);
+        applyWarp(reference.roiFramed, quad, reference.roiWarped);
+        comparison.roiMismatches += static_cast<uint64_t>(countNonZero(reference.roiWarped != reference.warped));
+
+        findContours(reference.roiWarped, reference.contours, RETR_TREE, CHAIN_APPROX_SIMPLE);
+        findCoordinates(reference.contours, reference.imageCentroids);
+        findContours(reference.roiCleaned, reference.contours, RETR_TREE, CHAIN_APPROX_SIMPLE, roi.tl());
+        findCoordinates(reference.contours, reference.pointCentroids);
+        warpCoordinates(reference.pointCentroids, quad, size, reference.pointCentroids);
+        //The steering takes the first centroid of --warp=image as it is, one without area does not steer
+        const bool imageCone = !reference.imageCentroids.empty() && std::isfinite(reference.imageCentroids[0].x)
+            && std::isfinite(reference.imageCentroids[0].y);
+        const bool pointCone = !reference.pointCentroids.empty();
+        if(imageCone && pointCone){
+            comparison.offsets.push_back(static_cast<float>(norm(reference.imageCentroids[0] - reference.pointCentroids[0])));
+        }else if(imageCone != pointCone){
+            comparison.unmatched++;
+        }
+    }
+    comparison.frames++;
+}
+
+void printWarpComparison(WarpComparison &comparison, std::ostream &out){
+    const double frames = (comparison.frames > 0) ? static_cast<double>(comparison.frames) : 1.0;
+    out << "warp over " << comparison.frames << " frames: " << comparison.remapMismatches / frames
+        << " pixels of the blue and yellow bird's-eye views per frame differ between applyWarp() and warpPerspective(), "
+        << comparison.roiMismatches / frames << " between the ROI and the whole frame";
+    std::vector<float> &offsets = comparison.offsets;
+    std::sort(offsets.begin(), offsets.end());
+    if(!offsets.empty()){
+        const size_t last = offsets.size() - 1;
+        out << "; the first cone of a colour moves by p50 " << offsets[last / 2] << " p75 " << offsets[last * 3 / 4]
+            << " max " << offsets[last] << " px from --warp=image to --warp=centroids in " << offsets.size() << " cases";
+    }
+    out << ", only one of them found a cone in " << comparison.unmatched << " cases";
+}
+
+void printStripComparison(const StripComparison &comparison, int rows, std::ostream &out){
+    const double frames = (comparison.frames > 0) ? static_cast<double>(comparison.frames) : 1.0;
+    out << "strips of " << rows << " rows over " << comparison.frames << " frames: " << comparison.mismatches / frames
+        << " mask pixels per frame differ from the whole ROI; " << comparison.stripSeconds * 1000.0 / frames
+        << " ms/frame against " << comparison.stageSeconds * 1000.0 / frames << " ms/frame stage by stage";
+}
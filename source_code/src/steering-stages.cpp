@@ -0,0 +1,779 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "steering-stages.hpp"
+#include "perf-counters.hpp"
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+using namespace cv;
+
+namespace {
+
+//Runs task(0) for the blue and task(1) for the yellow cones, on both threads if there is a worker.
+//They only write to their own ConeBranch.
+template <typename Task>
+void forBothBranches(BranchWorker *worker, FrameAllocations &allocations, const Task &task) {
+    if (tracingEnabled()) {
+        //Shows how the halves of a frame overlap; the wrapper is handed over by pointer as well
+        auto traced = [&](int branch) {
+            nameTraceThread("branch helper");
+            TraceScope trace((branch == 0) ? "blue cones" : "yellow cones");
+            task(branch);
+        };
+        if (worker != nullptr) {
+            worker->runPair(traced);
+            allocations.add(worker->lastAllocations());
+        } else {
+            traced(0);
+            traced(1);
+        }
+    } else if (worker != nullptr) {
+        worker->runPair(task);
+        allocations.add(worker->lastAllocations());
+    } else {
+        task(0);
+        task(1);
+    }
+}
+
+}  // namespace
+
+AcquisitionStage::AcquisitionStage(const AcquisitionOptions &options, RecordingReplay *replay, cluon::SharedMemory *sharedMemory,
+                                   const VehicleSignals &signals)
+    : m_options(options)
+    , m_replay(replay)
+    , m_sharedMemory(sharedMemory)
+    , m_signals(signals)
+    , m_nextFrame(0)
+    , m_counts{0, 0, 0, 0}
+    , m_changeDetector(CHANGE_SAMPLE_STEP, CHANGE_THRESHOLD)
+    , m_producerGaps() {}
+
+void AcquisitionStage::run(FrameBuffers &buffers) {
+    TraceScope trace("acquire", m_nextFrame);
+    StageCounters counters(CounterStage::Acquire);
+    buffers.allocations.begin();
+    buffers.frameNumber = m_nextFrame++;
+    buffers.quad = publishedWarpQuad();
+    Mat &img = buffers.image;
+
+    //Only the rows that can reach the bird's-eye view are segmented, blurred and searched for contours.
+    //The ROI only depends on the sliders, so it is known before the shared memory is locked.
+    const Rect previousRoi = buffers.roi;
+    buffers.roi = m_options.fullFrame ? Rect(0, 0, img.cols, img.rows) : getWarpSourceRoi(img.size(), buffers.quad);
+    const Rect roi = buffers.roi;
+    //With --acquire=rows only the full-width band of the ROI rows is copied; it is one contiguous block
+    const Range copiedRows = m_options.acquireRows ? Range(roi.y, roi.y + roi.height) : Range::all();
+    std::pair<bool, cluon::data::TimeStamp> timeStamp;
+
+    StageTimer copyTimer;
+    if (m_replay != nullptr) {
+        //The decoded frame is copied like the one in the shared memory
+        timeStamp = std::make_pair(true, m_replay->sampleTime());
+        Mat target = img.rowRange(copiedRows);
+        m_replay->frame().rowRange(copiedRows).copyTo(target);
+    } else {
+        // Lock the shared memory.
+        m_sharedMemory->lock();
+        {
+            timeStamp = m_sharedMemory->getTimeStamp();
+            // Copy the pixels from the shared memory into our own data structure.
+            // The lock is held for this copy only; processing runs while the producer writes the next frame.
+            cv::Mat wrapped(m_options.height, m_options.width, CV_8UC4, m_sharedMemory->data());
+            Mat target = img.rowRange(copiedRows);
+            wrapped.rowRange(copiedRows).copyTo(target);
+        }
+        m_sharedMemory->unlock();
+    }
+    copyTimer.stop(Stage::Copy);
+    //The producer stamps the frame with cluon::time::now() as well, so both times are on the same clock
+    buffers.acquireTime = cluon::time::toMicroseconds(cluon::time::now());
+    buffers.sampled = timeStamp.first;
+    buffers.sampleTime = timeStamp.first ? cluon::time::toMicroseconds(timeStamp.second) : 0;
+    if (m_options.acquireRows && roi != previousRoi) {
+        //Rows that are not copied anymore would keep an old frame in the display
+        img.rowRange(0, roi.y).setTo(Scalar::all(0));
+        img.rowRange(roi.y + roi.height, img.rows).setTo(Scalar::all(0));
+    }
+
+    m_counts.acquired++;
+    if (buffers.sampled) {
+        m_counts.dropped += m_producerGaps.add(buffers.sampleTime);
+    }
+    //The first frame is always processed, checkSide() needs it. Same distance test as the steering.
+    buffers.stopped = (m_signals.dis.load() > 0.03);
+    buffers.reused = false;
+    if (m_options.reuseUnchanged && buffers.frameNumber != 0) {
+        if (buffers.stopped) {
+            buffers.reused = true;
+            m_counts.stopped++;
+        } else if (!m_changeDetector.changed(img, roi)) {
+            buffers.reused = true;
+            m_counts.unchanged++;
+        }
+    } else if (m_options.reuseUnchanged) {
+        m_changeDetector.changed(img, roi);
+    }
+    buffers.allocations.mark("acquire");
+}
+
+SegmentationStage::SegmentationStage(const SegmentationOptions &options, std::atomic<bool> &trackLost)
+    : m_options(options)
+    , m_trackLost(trackLost)
+    , m_colorLut()
+    , m_worker(options.parallelBranches ? new BranchWorker() : nullptr)
+    , m_stripComparison{0, 0, 0.0, 0.0}
+    , m_stripReferences()
+    , m_verifiedFrames(0)
+    , m_segmentationMismatches(0) {
+    if (m_options.lutSegmentation) {
+        m_colorLut.update(m_options.blueRange, m_options.yellowRange);
+    }
+}
+
+void SegmentationStage::segmentRows(const Mat &src, ConeBranch &blue, ConeBranch &yellow, Mat &blueMask, Mat &yellowMask) {
+    if (m_options.fusedSegmentation) {
+        segmentConesFused(src, m_options.blueRange, m_options.yellowRange, blueMask, yellowMask, m_options.kernel);
+    } else if (m_options.lutSegmentation) {
+        m_colorLut.segment(src, blueMask, yellowMask);
+    } else {
+        applyFilter(src, 42, 99, 44, 155, 200, 79, blue.hsv, blueMask);
+        applyFilter(src, m_options.yellowRange.minHue, m_options.yellowRange.minSat, m_options.yellowRange.minVal,
+                    m_options.yellowRange.maxHue, m_options.yellowRange.maxSat, m_options.yellowRange.maxVal, yellow.hsv, yellowMask);
+    }
+}
+
+void SegmentationStage::cleanRows(const Mat &mask, Mat &scratch, Mat &cleaned) const {
+    if (m_options.cleanup == MaskCleanup::Morphology) {
+        openCloseMask(mask, scratch, cleaned);
+    } else {
+        reduceNoise(mask, scratch, cleaned);
+    }
+}
+
+void SegmentationStage::run(FrameBuffers &buffers) {
+    TraceScope trace("segment", buffers.frameNumber);
+    StageCounters counters(CounterStage::Segment);
+    buffers.allocations.resume();
+    if (buffers.reused || m_options.scanlines != 0) {
+        buffers.allocations.mark("segmentation");
+        return;
+    }
+    ConeBranch &blue = buffers.blue;
+    ConeBranch &yellow = buffers.yellow;
+    const Mat frame = buffers.image(buffers.roi);
+    //The occupancy of the blue columns is counted while the mask is written
+    std::vector<int> *blueColumns = m_options.continuousSide ? &blue.columns : nullptr;
+
+    //With --track the geometry stage searches the predicted windows of the frames that are not segmented here
+    buffers.detect = !m_options.tracking || (buffers.frameNumber % static_cast<uint32_t>(m_options.trackInterval) == 0) || m_trackLost.exchange(false);
+    if (!buffers.detect) {
+        buffers.segmentationSeconds = 0;
+        buffers.allocations.mark("segmentation");
+        return;
+    }
+    if (m_options.coarse) {
+        //The blob extraction on the small masks drops the specks, so they are not cleaned up
+        const auto start = std::chrono::steady_clock::now();
+        StageTimer timer;
+        segmentConesSampled(frame, m_options.coarseStep, m_options.blueRange, m_options.yellowRange, blue.mask, yellow.mask, blueColumns);
+        timer.stop(Stage::Segmentation);
+        buffers.segmentationSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        buffers.allocations.mark("segmentation");
+        return;
+    }
+    if (m_options.strips) {
+        //Segmentation and cleanup run strip by strip while the strip is still in cache, and only the rows of
+        //the strip itself are kept. At the edges of the ROI the window is moved inwards instead of being cut
+        //off, so every window has the same height and the strip buffers are never reallocated.
+        const auto start = std::chrono::steady_clock::now();
+        const int window = std::min(frame.rows, m_options.stripRows + 2 * STRIP_HALO);
+        blue.cleaned.create(frame.size(), CV_8UC1);
+        yellow.cleaned.create(frame.size(), CV_8UC1);
+        if (m_options.continuousSide) {
+            blue.columns.assign(frame.cols, 0);
+        }
+        for (int y0 = 0; y0 < frame.rows; y0 += m_options.stripRows) {
+            const int y1 = std::min(y0 + m_options.stripRows, frame.rows);
+            const int top = std::max(0, std::min(y0 - STRIP_HALO, frame.rows - window));
+            segmentRows(frame.rowRange(top, top + window), blue, yellow, blue.stripMask, yellow.stripMask);
+            for (int branch = 0; branch < 2; branch++) {
+                ConeBranch &cones = (branch == 0) ? blue : yellow;
+                cleanRows(cones.stripMask, cones.stripScratch, cones.stripCleaned);
+                Mat target = cones.cleaned.rowRange(y0, y1);
+                cones.stripCleaned.rowRange(y0 - top, y1 - top).copyTo(target);
+            }
+            if (m_options.continuousSide) {
+                for (int y = y0 - top; y < y1 - top; y++) {
+                    const uint8_t *row = blue.stripMask.ptr<uint8_t>(y);
+                    for (int x = 0; x < frame.cols; x++) {
+                        blue.columns[x] += row[x] != 0;
+                    }
+                }
+            }
+        }
+
+        if (m_options.compareStrips) {
+            m_stripComparison.stripSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            const auto stageStart = std::chrono::steady_clock::now();
+            segmentRows(frame, m_stripReferences[0], m_stripReferences[1], m_stripReferences[0].mask, m_stripReferences[1].mask);
+            for (ConeBranch &reference : m_stripReferences) {
+                cleanRows(reference.mask, reference.blurred, reference.cleaned);
+            }
+            m_stripComparison.stageSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - stageStart).count();
+            for (int branch = 0; branch < 2; branch++) {
+                ConeBranch &reference = m_stripReferences[branch];
+                absdiff(reference.cleaned, (branch == 0) ? blue.cleaned : yellow.cleaned, reference.framed);
+                m_stripComparison.mismatches += static_cast<uint64_t>(countNonZero(reference.framed));
+            }
+            m_stripComparison.frames++;
+            if (m_stripComparison.frames % COMPARISON_REPORT_INTERVAL == 0) {
+                std::clog << m_options.program << ": ";
+                printStripComparison(m_stripComparison, m_options.stripRows, std::clog);
+                std::clog << std::endl;
+            }
+        }
+        buffers.allocations.mark("strips");
+        return;
+    }
+    StageTimer segmentationTimer;
+    if (m_options.fusedSegmentation) {
+        //Both masks are written in the same pass over the frame
+        if (m_options.packedSegmentation) {
+            segmentConesFusedPacked(frame, m_options.blueRange, m_options.yellowRange, blue.packed, yellow.packed, m_options.kernel, blueColumns);
+        } else {
+            segmentConesFused(frame, m_options.blueRange, m_options.yellowRange, blue.mask, yellow.mask, m_options.kernel, blueColumns);
+        }
+        if (m_options.verifySegmentation) {
+            if (m_options.packedSegmentation) {
+                blue.packed.unpack(blue.mask);
+                yellow.packed.unpack(yellow.mask);
+            }
+            const int mismatches = countSegmentationMismatches(frame, m_options.blueRange, m_options.yellowRange, blue.mask, yellow.mask);
+            m_verifiedFrames++;
+            m_segmentationMismatches += static_cast<uint64_t>(mismatches);
+            if (mismatches != 0) {
+                std::clog << m_options.program << ": " << segmentationKernelName(m_options.kernel) << " kernel differs from the scalar reference in " << mismatches << " mask pixels." << std::endl;
+            }
+        }
+    } else if (m_options.lutSegmentation) {
+        m_colorLut.update(m_options.blueRange, m_options.yellowRange);
+        if (m_options.packedSegmentation) {
+            m_colorLut.segmentPacked(frame, blue.packed, yellow.packed, blueColumns);
+        } else {
+            m_colorLut.segment(frame, blue.mask, yellow.mask, blueColumns);
+        }
+    }
+    if (m_options.fusedSegmentation || m_options.lutSegmentation) {
+        segmentationTimer.stop(Stage::Segmentation);
+    }
+    buffers.allocations.mark("segmentation");
+
+    forBothBranches(m_worker.get(), buffers.allocations, [&](int branch) {
+        ConeBranch &cones = (branch == 0) ? blue : yellow;
+        StageTimer timer;
+        if (!m_options.fusedSegmentation && !m_options.lutSegmentation) {
+            if (branch == 0) {
+                applyFilter(frame, 42, 99, 44, 155, 200, 79, cones.hsv, cones.mask);
+                if (m_options.continuousSide) {
+                    countColumns(cones.mask, cones.columns);
+                }
+            } else {
+                applyFilter(frame, m_options.yellowRange.minHue, m_options.yellowRange.minSat, m_options.yellowRange.minVal,
+                            m_options.yellowRange.maxHue, m_options.yellowRange.maxSat, m_options.yellowRange.maxVal, cones.hsv, cones.mask);
+            }
+            timer.stop(Stage::Segmentation);
+        }
+        if (m_options.packedCleanup) {
+            if (!m_options.packedSegmentation) {
+                cones.packed.pack(cones.mask);
+            }
+            openClosePacked(cones.packed, cones.packedScratch, cones.packedCleaned);
+            timer.stop(Stage::NoiseReduction);
+            return;
+        }
+        if (m_options.packedSegmentation) {
+            //The other cleanups work on CV_8UC1 masks
+            cones.packed.unpack(cones.mask);
+        }
+        switch (m_options.cleanup) {
+            case MaskCleanup::Morphology:
+                openCloseMask(cones.mask, cones.blurred, cones.cleaned);
+                break;
+            case MaskCleanup::Components:
+                removeSmallComponents(cones.mask, MIN_CONE_AREA, cones.components, cones.cleaned);
+                break;
+            default:
+                //Both the blue and the yellow cones are givven a gaussian blur and put through the canny method
+                //Canny detects the edges of a given imag
+                reduceNoise(cones.mask, cones.blurred, cones.cleaned);
+                break;
+        }
+        timer.stop(Stage::NoiseReduction);
+    });
+    buffers.allocations.mark("branches");
+}
+
+GeometryStage::GeometryStage(const GeometryOptions &options, std::atomic<bool> &trackLost, uint32_t expectedFrames)
+    : m_options(options)
+    , m_trackLost(trackLost)
+    , m_worker(options.parallelBranches ? new BranchWorker() : nullptr)
+    , m_trackers{ConeTracker(TRACK_ALPHA, TRACK_BETA, TRACK_GATE, TRACK_MARGIN, TRACK_MAX_MISSES),
+                 ConeTracker(TRACK_ALPHA, TRACK_BETA, TRACK_GATE, TRACK_MARGIN, TRACK_MAX_MISSES)}
+    , m_scanlineDetector()
+    , m_coarseComparison{0, 0, 0, 0, 0.0, 0.0, 0.0}
+    , m_referenceBranches()
+    , m_warpComparison{0, 0, 0, 0, {}}
+    , m_warpReferences() {
+    //Two colours per frame
+    m_warpComparison.offsets.reserve(m_options.compareWarp ? 2 * static_cast<size_t>(expectedFrames) : 0);
+}
+
+void GeometryStage::blobCentroids(ConeBranch &cones) {
+    //extractBlobs() reserves the most blobs it returns, so a frame with more cones does not reallocate
+    cones.centroids.reserve(cones.blobs.capacity());
+    cones.centroids.resize(cones.blobs.size());
+    for (size_t i = 0; i < cones.blobs.size(); i++) {
+        cones.centroids[i] = cones.blobs[i].centroid;
+    }
+}
+
+void GeometryStage::contourBlobs(ConeBranch &cones) {
+    cones.blobs.clear();
+    for (size_t i = 0; i < cones.contours.size(); i++) {
+        const Point2f centroid = cones.centroids[i];
+        //Contours without area have no centroid
+        if (!std::isfinite(centroid.x) || !std::isfinite(centroid.y)) {
+            continue;
+        }
+        const Rect box = boundingRect(cones.contours[i]);
+        cones.blobs.push_back(ConeBlob{box.area(), centroid, box});
+    }
+}
+
+void GeometryStage::trackedCentroids(int branch, ConeBranch &cones) {
+    m_trackers[branch].output(cones.blobs);
+    blobCentroids(cones);
+    if (m_trackers[branch].lost()) {
+        m_trackLost.store(true);
+    }
+}
+
+void GeometryStage::findCentroids(const Mat &mask, Point offset, ConeBranch &cones) const {
+    StageTimer timer;
+    if (m_options.componentCentroids) {
+        extractBlobs(mask, MIN_CONE_AREA, MAX_CONE_BLOBS, offset, cones.components, cones.blobs);
+        blobCentroids(cones);
+    } else {
+        findContours(mask, cones.contours, RETR_TREE,CHAIN_APPROX_SIMPLE, offset);
+        findCoordinates(cones.contours, cones.centroids);
+    }
+    timer.stop(Stage::Contours);
+}
+
+void GeometryStage::run(FrameBuffers &buffers) {
+    TraceScope trace("geometry", buffers.frameNumber);
+    StageCounters counters(CounterStage::Geometry);
+    buffers.allocations.resume();
+    if (buffers.reused) {
+        if (m_options.tracking) {
+            //The filter counts in frames, so the tracks are moved ahead on a reused frame as well, only
+            //without a correction; the windows are not searched
+            for (int branch = 0; branch < 2; branch++) {
+                ConeBranch &cones = (branch == 0) ? buffers.blue : buffers.yellow;
+                m_trackers[branch].predict(buffers.roi, cones.blobs);
+                if (m_trackers[branch].lost()) {
+                    m_trackLost.store(true);
+                }
+            }
+        }
+        buffers.allocations.mark("geometry");
+        return;
+    }
+    ConeBranch &blue = buffers.blue;
+    ConeBranch &yellow = buffers.yellow;
+    if (m_options.scanlines != 0) {
+        //The blue samples per bird's-eye column are what the side detection counts in this mode
+        m_scanlineDetector.update(getWarpMatrix(buffers.quad), buffers.image.size(), m_options.scanlines, SCANLINE_BOTTOM);
+        m_scanlineDetector.detect(buffers.image, m_options.blueRange, m_options.yellowRange, SCANLINE_MIN_RUN, blue.centroids, yellow.centroids, &blue.columns);
+        buffers.allocations.mark("geometry");
+        return;
+    }
+    const Rect roi = buffers.roi;
+    const Size size = buffers.image.size();
+    const WarpQuad quad = buffers.quad;
+    const bool firstFrame = (buffers.frameNumber == 0);
+
+    //The warp cache is refreshed here, so both branches only read it
+    if (m_options.warpCentroids && !firstFrame) {
+        getWarpMatrix(quad);
+    } else {
+        prepareWarp(quad, size);
+    }
+
+    const auto geometryStart = std::chrono::steady_clock::now();
+    forBothBranches(m_worker.get(), buffers.allocations, [&](int branch) {
+        ConeBranch &cones = (branch == 0) ? blue : yellow;
+        if (!buffers.detect) {
+            //Only the windows around the predicted cones are segmented
+            m_trackers[branch].predict(roi, cones.blobs);
+            refineBlobs(buffers.image(roi), m_options.blueRange, m_options.yellowRange, branch == 0, 1, roi.tl(), m_options.kernel,
+                        cones.blobs, cones.windows[0], cones.windows[1]);
+            m_trackers[branch].correct(cones.blobs);
+            trackedCentroids(branch, cones);
+            warpCoordinates(cones.centroids, quad, size, cones.centroids);
+            return;
+        }
+        if (m_options.coarse) {
+            //The blobs of the small mask are in its own coordinates; refineBlobs() moves them into the frame
+            extractBlobs(cones.mask, std::max(1, MIN_CONE_AREA / (m_options.coarseStep * m_options.coarseStep)), MAX_CONE_BLOBS,
+                         Point(0, 0), cones.components, cones.blobs);
+            refineBlobs(buffers.image(roi), m_options.blueRange, m_options.yellowRange, branch == 0, m_options.coarseStep, roi.tl(), m_options.kernel,
+                        cones.blobs, cones.windows[0], cones.windows[1]);
+            blobCentroids(cones);
+            if (m_options.tracking) {
+                m_trackers[branch].associate(cones.blobs);
+                trackedCentroids(branch, cones);
+            }
+            warpCoordinates(cones.centroids, quad, size, cones.centroids);
+
+            if (branch == 0 && firstFrame) {
+                //checkSide() gets the small blue mask scaled back up to the ROI
+                resize(cones.mask, cones.cleaned, roi.size(), 0, 0, INTER_NEAREST);
+                placeInFrame(cones.cleaned, roi, size, cones.framed);
+                applyWarp(cones.framed, quad, cones.warped);
+            }
+            return;
+        }
+        //Only the blobs in camera space can be taken from the packed mask; the warp and findContours() need CV_8UC1
+        const bool packedBlobs = m_options.packedCleanup && m_options.warpCentroids && m_options.componentCentroids;
+        if (m_options.packedCleanup && (!packedBlobs || (branch == 0 && firstFrame))) {
+            cones.packedCleaned.unpack(cones.cleaned);
+        }
+        if (m_options.warpCentroids) {
+            //The blobs are found in camera space and only their centroids are moved into the bird's-eye view
+            if (packedBlobs) {
+                StageTimer timer;
+                extractBlobs(cones.packedCleaned, MIN_CONE_AREA, MAX_CONE_BLOBS, roi.tl(), cones.components, cones.blobs);
+                blobCentroids(cones);
+                timer.stop(Stage::Contours);
+            } else {
+                findCentroids(cones.cleaned, roi.tl(), cones);
+            }
+            if (m_options.tracking) {
+                if (!m_options.componentCentroids) {
+                    contourBlobs(cones);
+                }
+                m_trackers[branch].associate(cones.blobs);
+                trackedCentroids(branch, cones);
+            }
+            warpCoordinates(cones.centroids, quad, size, cones.centroids);
+
+            if (branch == 0 && firstFrame) {
+                //checkSide() needs the warped blue mask of the first frame
+                placeInFrame(cones.cleaned, roi, size, cones.framed);
+                applyWarp(cones.framed, quad, cones.warped);
+            }
+        } else {
+            placeInFrame(cones.cleaned, roi, size, cones.framed);
+            applyWarp(cones.framed, quad, cones.warped);
+            findCentroids(cones.warped, Point(0, 0), cones);
+        }
+    });
+    buffers.allocations.mark("geometry");
+
+    if (m_options.compareCoarse) {
+        //The original chain on the same frame, in camera space like the blobs before their centroids were warped
+        m_coarseComparison.coarseSeconds += buffers.segmentationSeconds
+            + std::chrono::duration<double>(std::chrono::steady_clock::now() - geometryStart).count();
+        const auto referenceStart = std::chrono::steady_clock::now();
+        segmentConesFused(buffers.image(roi), m_options.blueRange, m_options.yellowRange, m_referenceBranches[0].mask, m_referenceBranches[1].mask, m_options.kernel);
+        for (ConeBranch &reference : m_referenceBranches) {
+            reduceNoise(reference.mask, reference.blurred, reference.cleaned);
+            findContours(reference.cleaned, reference.contours, RETR_TREE, CHAIN_APPROX_SIMPLE, roi.tl());
+            findCoordinates(reference.contours, reference.centroids);
+        }
+        m_coarseComparison.referenceSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - referenceStart).count();
+        compareCentroids(blue.blobs, m_referenceBranches[0].centroids, m_coarseComparison);
+        compareCentroids(yellow.blobs, m_referenceBranches[1].centroids, m_coarseComparison);
+        m_coarseComparison.frames++;
+        if (m_coarseComparison.frames % COMPARISON_REPORT_INTERVAL == 0) {
+            std::clog << m_options.program << ": ";
+            printCoarseComparison(m_coarseComparison, m_options.coarseStep, std::clog);
+            std::clog << std::endl;
+        }
+    }
+    if (m_options.compareWarp) {
+        compareWarp(buffers.image, quad, m_options.blueRange, m_options.yellowRange, m_options.kernel, m_warpReferences, m_warpComparison);
+        if (m_warpComparison.frames % COMPARISON_REPORT_INTERVAL == 0) {
+            std::clog << m_options.program << ": ";
+            printWarpComparison(m_warpComparison, std::clog);
+            std::clog << std::endl;
+        }
+    }
+}
+
+ControlStage::ControlStage(const ControlOptions &options, VehicleSignals &signals, LatestValue<ViewerFrame> &viewerFrames,
+                           uint32_t expectedFrames)
+    : m_options(options)
+    , m_signals(signals)
+    , m_viewerFrames(viewerFrames)
+    , m_sideTracker{false, false, 0}
+    , m_grndSteerAngle(0)
+    , m_lastHasTarget(false)
+    , m_lastTarget()
+    , m_frameAges{0, 0, 0, 0, 0}
+    , m_replayLatencies() {
+    m_replayLatencies.reserve(m_options.replaying ? expectedFrames : 0);
+}
+
+bool ControlStage::run(FrameBuffers &buffers) {
+    TraceScope trace("control", buffers.frameNumber);
+    StageCounters counters(CounterStage::Control);
+    buffers.allocations.resume();
+    StageTimer timer;
+    //Read once, the OD4 thread may write a new distance at any time
+    const double dis = m_signals.dis.load();
+    const std::vector<cv::Point2f> &mcB = buffers.blue.centroids;
+    const std::vector<cv::Point2f> &mcY = buffers.yellow.centroids;
+
+    unsigned int len = 0;
+    bool hasTarget = false;
+    Point2f target;
+    
+    if (m_options.continuousSide) {
+        //With --coarse the columns are counted on the small mask, with --scanlines in the bird's-eye view, where
+        //checkSide() splits at column 320; frames that --track does not segment have none
+        if (buffers.detect && !buffers.reused) {
+            const int split = (m_options.scanlines != 0) ? 320 : (sideSplitColumn(buffers.quad) - buffers.roi.x) / m_options.coarseStep;
+            updateSide(buffers.blue.columns, split, m_sideTracker);
+        }
+    } else if(buffers.frameNumber==0){
+        if (m_options.scanlines != 0) {
+            //The first decision of updateSide() is the one checkSide() makes, here on the blue samples
+            updateSide(buffers.blue.columns, 320, m_sideTracker);
+        } else {
+            //The warp writes a CV_8UC1 mask, so it is counted as it is instead of being packed first
+            m_sideTracker.left = checkSide(buffers.blue.warped);
+            m_sideTracker.initialised = true;
+        }
+    }
+
+    //mcB/mcY are used instead of the contours since warpCoordinates() drops centroids outside the bird's-eye view
+    if(buffers.reused){
+        //Nothing of this frame was looked at, so the result of the last processed frame is sent again
+        if(buffers.stopped && m_lastHasTarget){
+            m_grndSteerAngle = 0;
+        }
+        target = m_lastTarget;
+        hasTarget = m_lastHasTarget;
+    } else if(mcB.size()>0 && mcY.size() > 0){ 
+        if(mcB[0].y<350 && mcY[0].y<350) {   
+            double midpointX = (mcB[0].x + mcY[0].x)/2;
+            double midpointY = (mcB[0].y + mcY[0].y)/2;
+
+            Point2f midpoint = Point2f(midpointX, midpointY);
+
+            double oppLength = 320 - midpoint.x;
+            double adLength = 450 - midpoint.y;
+
+            double midpointRadian = calculateInverse(adLength, oppLength);
+            double midpointRadian2 = midpointRadian -(midpointRadian/2);
+
+            if(dis > 0.03){
+                m_grndSteerAngle = 0;
+            }else{ 
+                if(midpointRadian2 > 0.4 || midpointRadian2 <-0.4){
+                    m_grndSteerAngle = midpointRadian2 - (midpointRadian2/1.25);
+                }
+                else{
+                    m_grndSteerAngle = midpointRadian2; 
+                }                  
+            }
+            target = midpoint;
+            hasTarget = true;
+        }
+   } else if(mcB.size()>0){
+            len = 0;   
+         if(mcB[len].y < 350){
+            len = mcB.size()-1;
+            double cLength;
+            //circle(warpedImgCombined,mcB[len],4,color,-1,8,0);
+             if(m_sideTracker.left){
+                  cLength = 320 - mcB[len].x;
+                }else{
+                    cLength=mcB[len].x-320;
+                }
+            double bLength = 450 - mcB[len].y;
+            double radian {calculateInverse(bLength,cLength)};
+            double angle {calculateAngle(radian)};
+            double radian2 = radian - (radian/2);
+
+            if(dis >0.03){
+                m_grndSteerAngle = 0;
+            }else{
+                if(radian2 > 0.4 || radian2 <-0.4){
+                    m_grndSteerAngle = radian2 - (radian2/1.25);
+                }
+                else{
+                    m_grndSteerAngle = radian - (radian/ 2);
+                }
+                
+            }                     
+                target = mcB[len];
+                hasTarget = true;
+           }
+       }
+
+     
+    
+    m_lastTarget = target;
+    m_lastHasTarget = hasTarget;
+    timer.stop(Stage::Steering);
+
+    buffers.allocations.mark("steering");
+
+    // If you want to access the latest received ground steering, don't forget to lock the mutex:
+    double originalSteering;
+    {
+        
+    std::lock_guard<std::mutex> lck(m_signals.gsrMutex);
+    TraceScope held("gsrMutex held", buffers.frameNumber);
+    originalSteering = m_signals.gsr.groundSteering();
+    if (buffers.sampled) {
+        //Stamped with the sample time of the frame that the decision is based on
+        std::cout <<"group_06;"<<buffers.sampleTime<<";"<<m_grndSteerAngle<<std::endl;
+    } else {
+        std::cout <<"group_06;"<<m_signals.sec<<m_signals.time<<";"<<m_grndSteerAngle<<std::endl;
+    }
+        
+    }
+    timer.stop(Stage::Output);
+    if (m_options.replaying) {
+        //The recorded time stamps are far in the past, only the time since the acquisition means something
+        m_replayLatencies.push_back(cluon::time::toMicroseconds(cluon::time::now()) - buffers.acquireTime);
+    } else if (buffers.sampled) {
+        const int64_t acquired = buffers.acquireTime - buffers.sampleTime;
+        const int64_t decided = cluon::time::toMicroseconds(cluon::time::now()) - buffers.sampleTime;
+        m_frameAges.frames++;
+        m_frameAges.acquiredSum += acquired;
+        m_frameAges.acquiredMax = std::max(m_frameAges.acquiredMax, acquired);
+        m_frameAges.decidedSum += decided;
+        m_frameAges.decidedMax = std::max(m_frameAges.decidedMax, decided);
+        if (m_options.frameAge) {
+            std::clog << m_options.program << ": frame " << buffers.frameNumber << " sampled at " << buffers.sampleTime
+                      << " us, acquired after " << acquired << " us, steered after " << decided << " us" << std::endl;
+        }
+    }
+    buffers.allocations.mark("output");
+    if (stageReportRequested()) {
+        printStageLatencies(std::clog);
+    }
+
+    if (m_options.verbose) {
+        //The only extra copy of the frame; it goes into a buffer that the viewer is not drawing from
+        ViewerFrame &view = m_viewerFrames.back();
+        buffers.image.copyTo(view.image);
+        view.frameNumber = buffers.frameNumber;
+        view.hasTarget = hasTarget;
+        view.target = target;
+        view.steering = m_grndSteerAngle;
+        view.originalSteering = originalSteering;
+        m_viewerFrames.publish();
+    }
+    buffers.allocations.mark("display");
+
+    buffers.framesProcessed++;
+    if (m_options.checkAllocations && ALLOCATION_COUNTER_ENABLED) {
+        std::clog << m_options.program << ": frame " << buffers.frameNumber << " allocated ";
+        buffers.allocations.print(std::clog);
+        std::clog << std::endl;
+        //Every set of buffers is sized by the first frames that go through it. Only the chain of allocationFree
+        //is held to zero: the default chain and the others with Canny, morphologyEx() or findContours() cannot be,
+        //since OpenCV builds the filter engines, the Canny edge map and the contour storage with fastMalloc()
+        //inside every call, without a way to hand them buffers that are kept between frames
+        if (m_options.allocationFree && buffers.framesProcessed > ALLOCATION_WARMUP_FRAMES && buffers.allocations.total() != 0) {
+            std::cerr << m_options.program << ": steady-state frame allocated on the heap." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+FrameViewer::FrameViewer(const ViewerOptions &options, const std::string &windowName, LatestValue<ViewerFrame> &frames,
+                         const std::atomic<bool> &running)
+    : m_options(options)
+    , m_windowName(windowName)
+    , m_frames(frames)
+    , m_running(running) {}
+
+void FrameViewer::run() {
+    RNG rng(12345);                
+    Scalar color= Scalar(rng.uniform(0,225), rng.uniform(0,255), rng.uniform(0,255));            
+    Point lineStart = Point(320, 350);
+    Mat drawing;
+    nameTraceThread("viewer");
+    //The window and the sliders live as long as the viewer; every frame only redraws the quad corners
+    makeTrackbar(m_options.width, m_options.height);
+    while (m_running.load()) {
+        if (!m_frames.update()) {
+            //Keeps the windows and the sliders responsive while there is no new frame
+            cv::waitKey(1);
+            continue;
+        }
+        ViewerFrame &view = m_frames.front();
+        Mat &img = view.image;
+
+        showTrackbar(img);
+
+        //applyWarp() keeps the frame size, so the drawing has the same size in both modes
+        drawing.create(img.size(), CV_8UC3);
+        drawing.setTo(Scalar::all(0));
+        if (view.hasTarget) {
+            line(drawing, lineStart, view.target, color, 5);
+            line(drawing, lineStart, Point(320, view.target.y), Scalar(0,255,0), 5);
+            line(drawing, view.target, Point(320, view.target.y), Scalar(0,0,255), 5);
+        }
+
+        char angleResults[96];
+        snprintf(angleResults, sizeof(angleResults), "ours: %f original: %f", view.steering, view.originalSteering);
+        putText(img, angleResults , Point(5, 200), cv::FONT_HERSHEY_DUPLEX, 1.0, CV_RGB(118, 185, 0), 2);
+
+        // Display image on your screen.
+        cv::imshow(m_windowName.c_str(), img);
+        
+        //cv::imshow("with rect", drawing);
+        cv::imshow("cones", drawing);
+        //cv::imshow("yellow cones", yellowCones);
+        //cv::imshow("blue cones", blueCones);
+        //cv::imshow("with g blurr", gBlurredImg);
+        //cv::imshow("with dilation", dilatedImg);
+        //cv::imshow("with dilation and canny", cannyDilateYellow);
+
+        cv::waitKey(1);
+        //Slider moves handled by waitKey() reach the acquisition of the next frame
+        publishWarpQuad(sliderWarpQuad());
+    }
+}
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STEERING_STAGES_HPP
+#define STEERING_STAGES_HPP
+
+#include "cluon-complete.hpp"
+#include "opendlv-standard-message-set.hpp"
+#include "allocation-counter.hpp"
+#include "cone-segmentation.hpp"
+#include "cone-tracker.hpp"
+#include "frame-pipeline.hpp"
+#include "frame-skipping.hpp"
+#include "frame-trace.hpp"
+#include "recording-replay.hpp"
+#include "scanline-detector.hpp"
+#include "stage-timing.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//The stages of the frame loop of steering-service.cpp. Every stage owns its state and only shares the FrameBuffers
+//of the frame it works on and what its constructor is handed explicitly, so that it can run on a thread of its own.
+
+//Corners of the warp source quad that are set with the trackbars
+struct WarpQuad {
+    int xLeft;
+    int xRight;
+    int y;
+};
+
+//Extra rows around the warp source quad so that the 5x5 blur and Canny see the same neighbourhood as on the full frame
+const int ROI_HALO = 8;
+
+//With --cleanup=components blobs with fewer pixels are treated as noise
+const int MIN_CONE_AREA = 16;
+//With --centroids=components at most this many blobs per colour are kept, the ones closest to the car
+const size_t MAX_CONE_BLOBS = 64;
+//With --compare-coarse a full-resolution centroid counts as found if a coarse one is at most this many px away
+const float COARSE_MATCH_DISTANCE = 10.0f;
+//With --compare-coarse and --compare-strips the comparison is printed every this many frames
+const uint32_t COMPARISON_REPORT_INTERVAL = 100;
+
+//With --track: weights of the alpha-beta filter, largest distance in px between a prediction and its blob,
+//margin in px around the search windows and frames a cone may go unseen before its track is dropped
+const float TRACK_ALPHA = 0.5f;
+const float TRACK_BETA = 0.1f;
+const float TRACK_GATE = 20.0f;
+const int TRACK_MARGIN = 6;
+const int TRACK_MAX_MISSES = 2;
+
+//With --reuse-unchanged every this many pixels and rows of the ROI are compared with the last processed frame,
+//and a mean absolute difference of at most CHANGE_THRESHOLD (in 8-bit levels) counts as unchanged
+const int CHANGE_SAMPLE_STEP = 8;
+const double CHANGE_THRESHOLD = 2.0;
+
+//With --strips every strip is segmented and cleaned up with this many extra rows above and below it, the same
+//neighbourhood as the ROI keeps for the 5x5 blur, Canny and the open/close
+const int STRIP_HALO = ROI_HALO;
+
+//With --scanlines the scanlines are spread over the bird's-eye rows above SCANLINE_BOTTOM, the lowest row at
+//which the steering still takes a cone, and runs shorter than SCANLINE_MIN_RUN px are noise
+const int SCANLINE_BOTTOM = 350;
+const int SCANLINE_MIN_RUN = 2;
+
+//Work buffers of one colour. They are kept from frame to frame, so after the first frame
+//create() finds the right size and nothing is allocated again.
+struct ConeBranch {
+    cv::Mat hsv;      //only used by the split segmentation
+    cv::Mat mask;     //segmentation result on the ROI
+    cv::Mat blurred;  //scratch of the cleanup: blurred mask (canny) or opened mask (morphology)
+    ComponentBuffers components;  //labels of --cleanup=components and --centroids=components
+    cv::Mat cleaned;  //cleanup result on the ROI
+    PackedMask packed;         //segmentation result with --packed-masks
+    PackedMask packedScratch;
+    PackedMask packedCleaned;  //morphology result with --packed-masks
+    std::vector<int> columns;  //pixels per column of the mask on the ROI, only blue and with --side=continuous
+    cv::Mat windows[2];        //--coarse: full-resolution blue and yellow masks around one coarse blob
+    cv::Mat stripMask;         //--strips: segmentation, cleanup scratch and cleanup result of one strip
+    cv::Mat stripScratch;
+    cv::Mat stripCleaned;
+    cv::Mat framed;   //cleaned mask placed in a full-size frame
+    cv::Mat warped;   //bird's-eye view
+    std::vector<std::vector<cv::Point> > contours;
+    std::vector<ConeBlob> blobs;
+    std::vector<cv::Point2f> centroids;
+};
+
+//Buffer pool of one frame in flight: the frame copied out of the shared memory and everything derived from it
+struct FrameBuffers {
+    uint32_t frameNumber{0};
+    uint32_t framesProcessed{0};  //frames that have gone through this set of buffers
+    WarpQuad quad{0, 0, 0};       //sliders at the time the frame was acquired
+    bool sampled{false};          //the producer put a time stamp into the shared memory with the frame
+    int64_t sampleTime{0};        //that time stamp in microseconds
+    int64_t acquireTime{0};       //microseconds on the same clock when the frame had been copied out
+    double segmentationSeconds{0};  //only measured with --compare-coarse
+    bool detect{true};            //false on the frames on which --track only searches the predicted windows
+    bool reused{false};           //--reuse-unchanged: the vision stages skip the frame and the last steering is sent again
+    bool stopped{false};          //the car stood still when the frame was acquired
+    FrameAllocations allocations;
+    cv::Mat image;
+    cv::Rect roi;
+    ConeBranch blue;
+    ConeBranch yellow;
+};
+
+//What the viewer needs to draw a frame: a copy of the camera image and the steering decision
+struct ViewerFrame {
+    uint32_t frameNumber{0};
+    cv::Mat image;
+    bool hasTarget{false};
+    cv::Point2f target;
+    double steering{0};
+    double originalSteering{0};
+};
+
+//Side of the blue cones and the state of the continuous side detection. The side only changes after the blue
+//pixels on the other side have outnumbered the ones on the current side by SIDE_HYSTERESIS for SIDE_SWITCH_FRAMES
+//frames in a row.
+struct SideTracker {
+    bool initialised;
+    bool left;  //the blue cones are on the left
+    int pendingFrames;
+};
+const double SIDE_HYSTERESIS = 1.5;
+const int SIDE_SWITCH_FRAMES = 5;
+//Only reads and writes tracker and returns tracker.left, so that every tracker keeps its own side
+bool updateSide(const std::vector<int> &columns, int split, SideTracker &tracker);
+
+//What happened to the frames of the producer; only the acquisition updates it
+struct FrameCounts {
+    uint64_t acquired;
+    uint64_t unchanged;  //reused since they hardly differ from the last processed frame
+    uint64_t stopped;    //reused since the car stood still
+    uint64_t dropped;    //sent by the producer but never acquired, from the gaps between the time stamps
+};
+void printFrameCounts(const FrameCounts &counts, std::ostream &out);
+
+//Age of the frames in microseconds since the producer sampled them; only the control stage updates it.
+//The time from sampling to acquisition is spent in the producer and in waiting for us to take the frame,
+//the time from acquisition to decision in the stages and in waiting for their threads.
+struct FrameAges {
+    uint64_t frames;  //frames that came with a time stamp
+    int64_t acquiredSum;
+    int64_t acquiredMax;
+    int64_t decidedSum;
+    int64_t decidedMax;
+};
+void printFrameAges(const FrameAges &ages, std::ostream &out);
+//Throughput of --replay and the latency from the acquisition to the steering of every frame in microseconds
+void printReplayBenchmark(std::vector<int64_t> &latencies, double seconds, double decodeSeconds, std::ostream &out);
+
+//Running totals of --compare-strips; only the segmentation stage updates them
+struct StripComparison {
+    uint64_t frames;
+    uint64_t mismatches;  //pixels of the cleaned masks that differ from the ones of the whole ROI
+    double stripSeconds;
+    double stageSeconds;
+};
+void printStripComparison(const StripComparison &comparison, int rows, std::ostream &out);
+
+//Running totals of --compare-coarse; only the geometry stage updates them
+struct CoarseComparison {
+    uint64_t frames;
+    uint64_t matched;  //full-resolution centroids with a coarse centroid within COARSE_MATCH_DISTANCE
+    uint64_t missed;   //full-resolution centroids without one
+    uint64_t extra;    //coarse centroids without a full-resolution centroid within COARSE_MATCH_DISTANCE
+    double error;      //sum of the distances of the matched centroids
+    double coarseSeconds;
+    double referenceSeconds;
+};
+void compareCentroids(const std::vector<ConeBlob> &coarse, const std::vector<cv::Point2f> &reference, CoarseComparison &comparison);
+void printCoarseComparison(const CoarseComparison &comparison, int step, std::ostream &out);
+
+//Running totals of --compare-warp; only the geometry stage updates them
+struct WarpComparison {
+    uint64_t frames;
+    uint64_t remapMismatches;  //pixels where applyWarp() differs from warpPerspective()
+    uint64_t roiMismatches;    //pixels where the bird's-eye view of the ROI differs from the one of the whole frame
+    uint64_t unmatched;        //colours of a frame for which only one of --warp=image and --warp=centroids found a cone
+    std::vector<float> offsets;  //distance in px between the first cone of a colour of both
+};
+//Buffers of --compare-warp for one colour, kept from frame to frame
+struct WarpReference {
+    cv::Mat mask;         //segmentation, cleanup and bird's-eye view of the whole frame
+    cv::Mat blurred;
+    cv::Mat cleaned;
+    cv::Mat warped;
+    cv::Mat perspective;  //warpPerspective() of cleaned
+    cv::Mat roiMask;      //the same on the ROI of getWarpSourceRoi()
+    cv::Mat roiCleaned;
+    cv::Mat roiFramed;
+    cv::Mat roiWarped;
+    std::vector<std::vector<cv::Point> > contours;
+    std::vector<cv::Point2f> imageCentroids;  //--warp=image: centroids of the contours of roiWarped
+    std::vector<cv::Point2f> pointCentroids;  //--warp=centroids: warped centroids of the contours of roiCleaned
+};
+void compareWarp(const cv::Mat &image, const WarpQuad &quad, const HsvRange &blueRange, const HsvRange &yellowRange,
+                 SegmentationKernel kernel, WarpReference (&references)[2], WarpComparison &comparison);
+void printWarpComparison(WarpComparison &comparison, std::ostream &out);
+
+//Frames per set of buffers that may still allocate with --check-allocations; the first one sizes all buffers
+const uint32_t ALLOCATION_WARMUP_FRAMES = 2;
+
+//The options of the command line that each stage looks at; every stage keeps its own copy of its own struct
+struct AcquisitionOptions {
+    uint32_t width{0};
+    uint32_t height{0};
+    bool fullFrame{false};
+    bool acquireRows{false};
+    bool reuseUnchanged{false};
+};
+
+struct SegmentationOptions {
+    std::string program;  //argv[0], the prefix of the log lines
+    bool fusedSegmentation{false};
+    bool lutSegmentation{false};
+    SegmentationKernel kernel{SegmentationKernel::Scalar};
+    bool verifySegmentation{false};
+    MaskCleanup cleanup{MaskCleanup::Canny};
+    bool packedSegmentation{false};
+    bool packedCleanup{false};
+    bool continuousSide{false};
+    int scanlines{0};
+    bool coarse{false};
+    int coarseStep{1};
+    bool strips{false};
+    int stripRows{0};
+    bool compareStrips{false};
+    int trackInterval{1};
+    bool tracking{false};
+    bool parallelBranches{false};
+    HsvRange blueRange{0, 0, 0, 0, 0, 0};
+    HsvRange yellowRange{0, 0, 0, 0, 0, 0};
+};
+
+struct GeometryOptions {
+    std::string program;
+    SegmentationKernel kernel{SegmentationKernel::Scalar};  //of the reference masks of --compare-warp
+    bool componentCentroids{false};
+    bool packedCleanup{false};
+    int scanlines{0};
+    bool coarse{false};
+    int coarseStep{1};
+    bool compareCoarse{false};
+    bool compareWarp{false};
+    bool tracking{false};
+    bool warpCentroids{false};
+    bool parallelBranches{false};
+    HsvRange blueRange{0, 0, 0, 0, 0, 0};
+    HsvRange yellowRange{0, 0, 0, 0, 0, 0};
+};
+
+struct ControlOptions {
+    std::string program;
+    bool replaying{false};
+    bool verbose{false};
+    bool continuousSide{false};
+    int scanlines{0};
+    int coarseStep{1};
+    bool frameAge{false};
+    bool checkAllocations{false};
+    bool allocationFree{false};  //--check-allocations fails on a steady-state frame that allocates
+};
+
+struct ViewerOptions {
+    uint32_t width{0};
+    uint32_t height{0};
+};
+
+//What the OD4 session (or the recording) last sent; written by the callbacks of its messages
+struct VehicleSignals {
+    std::mutex gsrMutex;  //guards gsr, sec and time
+    opendlv::proxy::GroundSteeringRequest gsr{};
+    std::int32_t sec{0};
+    std::int32_t time{0};
+    std::atomic<double> dis{0.0};  //distance reading; the car counts as stopped above 0.03
+};
+
+//Helpers of steering-service.cpp that the stages use
+void applyFilter(const cv::Mat &image, int minHue, int minSat, int minVal, int maxHue, int maxSat, int maxVal, cv::Mat &hsv, cv::Mat &filteredCones);
+void findCoordinates(const std::vector<std::vector<cv::Point> > &contours, std::vector<cv::Point2f> &mc);
+void reduceNoise(const cv::Mat &image, cv::Mat &gBlurredImg, cv::Mat &cannyImg);
+void applyWarp(const cv::Mat &image, const WarpQuad &quad, cv::Mat &warpedImg);
+void prepareWarp(const WarpQuad &quad, cv::Size size);
+cv::Mat getWarpMatrix(const WarpQuad &quad);
+void warpCoordinates(const std::vector<cv::Point2f> &points, const WarpQuad &quad, cv::Size size, std::vector<cv::Point2f> &warped);
+cv::Rect getWarpSourceRoi(cv::Size size, const WarpQuad &quad);
+WarpQuad sliderWarpQuad();
+void publishWarpQuad(const WarpQuad &quad);
+WarpQuad publishedWarpQuad();
+void placeInFrame(const cv::Mat &roiImage, cv::Rect roi, cv::Size size, cv::Mat &frame);
+double calculateInverse(double bLength, double cLength);
+double calculateAngle(double inverse);
+void makeTrackbar(int WIDTH, int HEIGHT);
+void showTrackbar(const cv::Mat &image);
+//True if the warped blue mask has at least as many pixels left of column 320 as right of it
+bool checkSide(cv::Mat image);
+int sideSplitColumn(const WarpQuad &quad);
+
+//Copies the frame out of the shared memory, or out of the recording with --replay, and decides whether the other
+//stages look at it at all
+class AcquisitionStage {
+   public:
+    //Exactly one of replay and sharedMemory is set
+    AcquisitionStage(const AcquisitionOptions &options, RecordingReplay *replay, cluon::SharedMemory *sharedMemory,
+                     const VehicleSignals &signals);
+    AcquisitionStage(const AcquisitionStage &) = delete;
+    AcquisitionStage &operator=(const AcquisitionStage &) = delete;
+
+    //Waits for the next frame of the producer, or decodes the next one of the recording and hands the messages
+    //recorded before it to onMessage. Returns false when the recording has no more frames.
+    template <typename Handler>
+    bool wait(Handler &&onMessage) {
+        StageTimer waitTimer;
+        TraceScope trace("wait");
+        bool available = true;
+        if (m_replay != nullptr) {
+            available = m_replay->decodeNext(onMessage);
+        } else {
+            m_sharedMemory->wait();
+        }
+        waitTimer.stop(Stage::Wait);
+        return available;
+    }
+
+    void run(FrameBuffers &buffers);
+
+    const FrameCounts &counts() const {
+        return m_counts;
+    }
+    //Frame period of the producer in us as far as the acquired frames show it, 0 until it is known
+    int64_t producerPeriod() const {
+        return m_producerGaps.period();
+    }
+
+   private:
+    const AcquisitionOptions m_options;
+    RecordingReplay *m_replay;
+    cluon::SharedMemory *m_sharedMemory;
+    const VehicleSignals &m_signals;
+    uint32_t m_nextFrame;
+    FrameCounts m_counts;
+    FrameChangeDetector m_changeDetector;
+    ProducerGapCounter m_producerGaps;
+};
+
+//Segments the ROI into the blue and the yellow mask and cleans them up. On the frames that --track does not
+//segment it only clears trackLost, which the geometry stage sets when a track was lost.
+class SegmentationStage {
+   public:
+    SegmentationStage(const SegmentationOptions &options, std::atomic<bool> &trackLost);
+    SegmentationStage(const SegmentationStage &) = delete;
+    SegmentationStage &operator=(const SegmentationStage &) = delete;
+
+    void run(FrameBuffers &buffers);
+
+    //Share of all BGR colours that --segmentation=lut puts into another class than the exact HSV test
+    double lutError() const {
+        return m_colorLut.quantisationError();
+    }
+    const StripComparison &stripComparison() const {
+        return m_stripComparison;
+    }
+    //--verify-segmentation: frames checked and mask pixels that differed from the scalar reference
+    uint64_t verifiedFrames() const {
+        return m_verifiedFrames;
+    }
+    uint64_t segmentationMismatches() const {
+        return m_segmentationMismatches;
+    }
+
+   private:
+    //Segments src into both masks with the method chosen by --segmentation
+    void segmentRows(const cv::Mat &src, ConeBranch &blue, ConeBranch &yellow, cv::Mat &blueMask, cv::Mat &yellowMask);
+    //The two cleanups that only look at a few neighbouring rows
+    void cleanRows(const cv::Mat &mask, cv::Mat &scratch, cv::Mat &cleaned) const;
+
+    const SegmentationOptions m_options;
+    std::atomic<bool> &m_trackLost;
+    //The lookup table only depends on the HSV bounds, so it is built before the first frame
+    ConeColorLut m_colorLut;
+    std::unique_ptr<BranchWorker> m_worker;  //--parallel-branches
+    StripComparison m_stripComparison;
+    ConeBranch m_stripReferences[2];  //--compare-strips
+    uint64_t m_verifiedFrames;
+    uint64_t m_segmentationMismatches;
+};
+
+//Finds the cones in the masks and moves them into the bird's-eye view, or detects them on the scanlines
+class GeometryStage {
+   public:
+    //expectedFrames sizes the offsets of --compare-warp, 0 if unknown
+    GeometryStage(const GeometryOptions &options, std::atomic<bool> &trackLost, uint32_t expectedFrames);
+    GeometryStage(const GeometryStage &) = delete;
+    GeometryStage &operator=(const GeometryStage &) = delete;
+
+    void run(FrameBuffers &buffers);
+
+    const CoarseComparison &coarseComparison() const {
+        return m_coarseComparison;
+    }
+    //Not const, printWarpComparison() sorts the offsets
+    WarpComparison &warpComparison() {
+        return m_warpComparison;
+    }
+
+   private:
+    static void blobCentroids(ConeBranch &cones);
+    //--track needs a box for every centroid to size the search windows
+    static void contourBlobs(ConeBranch &cones);
+    //Replaces the blobs by the filtered positions of the tracks
+    void trackedCentroids(int branch, ConeBranch &cones);
+    //Centroids of the blobs of a mask, from the contours or from one labelling pass with --centroids=components
+    void findCentroids(const cv::Mat &mask, cv::Point offset, ConeBranch &cones) const;
+
+    const GeometryOptions m_options;
+    std::atomic<bool> &m_trackLost;
+    std::unique_ptr<BranchWorker> m_worker;  //--parallel-branches
+    //The blue and the yellow tracks of --track, each branch its own
+    ConeTracker m_trackers[2];
+    ScanlineDetector m_scanlineDetector;
+    CoarseComparison m_coarseComparison;
+    ConeBranch m_referenceBranches[2];  //--compare-coarse
+    WarpComparison m_warpComparison;
+    WarpReference m_warpReferences[2];
+};
+
+//Computes and sends the steering angle. It does no GUI work: with --verbose the frame and the steering decision
+//are handed to the viewer thread, which never holds up this stage.
+class ControlStage {
+   public:
+    //expectedFrames sizes the latencies of --replay, 0 if unknown
+    ControlStage(const ControlOptions &options, VehicleSignals &signals, LatestValue<ViewerFrame> &viewerFrames,
+                 uint32_t expectedFrames);
+    ControlStage(const ControlStage &) = delete;
+    ControlStage &operator=(const ControlStage &) = delete;
+
+    //Returns false if --check-allocations failed
+    bool run(FrameBuffers &buffers);
+
+    const FrameAges &frameAges() const {
+        return m_frameAges;
+    }
+    //Microseconds from the acquisition to the steering of every frame of --replay; not const, the report sorts them
+    std::vector<int64_t> &replayLatencies() {
+        return m_replayLatencies;
+    }
+
+   private:
+    const ControlOptions m_options;
+    VehicleSignals &m_signals;
+    LatestValue<ViewerFrame> &m_viewerFrames;
+    SideTracker m_sideTracker;
+    double m_grndSteerAngle;
+    //The result that --reuse-unchanged sends again
+    bool m_lastHasTarget;
+    cv::Point2f m_lastTarget;
+    FrameAges m_frameAges;
+    std::vector<int64_t> m_replayLatencies;
+};
+
+//Draws the newest frame that the control stage has handed over; frames that arrive while it is drawing are
+//dropped. It owns the OpenCV windows and the sliders and only runs with --verbose, on a thread of its own.
+class FrameViewer {
+   public:
+    FrameViewer(const ViewerOptions &options, const std::string &windowName, LatestValue<ViewerFrame> &frames,
+                const std::atomic<bool> &running);
+    FrameViewer(const FrameViewer &) = delete;
+    FrameViewer &operator=(const FrameViewer &) = delete;
+
+    //Returns once running is cleared
+    void run();
+
+   private:
+    const ViewerOptions m_options;
+    const std::string m_windowName;
+    LatestValue<ViewerFrame> &m_frames;
+    const std::atomic<bool> &m_running;
+};
+
+#endif
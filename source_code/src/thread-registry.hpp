@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREAD_REGISTRY_HPP
+#define THREAD_REGISTRY_HPP
+
+#include <csignal>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Plumbing shared by the debug reports (stage timing, frame trace) that record on every thread of the frame loop
+// and are read from another one.
+
+// One record per thread, made by the first call of own() on that thread; after that own() neither locks nor
+// allocates. Only the owning thread writes its record, so its fields only need relaxed atomics to make the
+// concurrent reads of forEach() well defined. Records are never freed, so the data of finished threads is still
+// reported. There is one registry per Record type.
+template <typename Record>
+class ThreadRegistry {
+   public:
+    ThreadRegistry()
+        : m_mutex()
+        , m_records() {}
+    ThreadRegistry(const ThreadRegistry &) = delete;
+    ThreadRegistry &operator=(const ThreadRegistry &) = delete;
+
+    // create(index) makes the record of a new thread; index counts the threads from 0.
+    template <typename Create>
+    Record &own(const Create &create) {
+        if (s_own == nullptr) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            s_own = create(m_records.size());
+            m_records.push_back(s_own);
+        }
+        return *s_own;
+    }
+
+    // Calls visit() with every record; no thread is registered meanwhile.
+    template <typename Visit>
+    void forEach(const Visit &visit) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const Record *record : m_records) {
+            visit(*record);
+        }
+    }
+
+   private:
+    static thread_local Record *s_own;
+    std::mutex m_mutex;
+    std::vector<Record *> m_records;
+};
+
+template <typename Record>
+thread_local Record *ThreadRegistry<Record>::s_own = nullptr;
+
+// A signal that only leaves a request behind. The frame loop polls requested() between frames, since printing
+// or writing a file inside the handler would not be async-signal-safe.
+template <int SIGNAL>
+class PolledSignal {
+   public:
+    static void install() {
+        std::signal(SIGNAL, onSignal);
+    }
+
+    // Returns true once for every request.
+    static bool requested() {
+        if (s_requested == 0) {
+            return false;
+        }
+        s_requested = 0;
+        return true;
+    }
+
+   private:
+    static void onSignal(int) {
+        s_requested = 1;
+    }
+
+    static volatile std::sig_atomic_t s_requested;
+};
+
+template <int SIGNAL>
+volatile std::sig_atomic_t PolledSignal<SIGNAL>::s_requested = 0;
+
+#endif
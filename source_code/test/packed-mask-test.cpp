@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the packed masks of --packed-masks with the CV_8UC1 functions they stand in for, on random masks of
+// sizes that do and do not fill their last word. Prints every difference and returns 1 if there was one.
+
+#include "cone-segmentation.hpp"
+#include "packed-mask.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void fail(const std::string &test, const std::string &what) {
+    std::cerr << test << ": " << what << std::endl;
+    failures++;
+}
+
+// Masks with blobs of a few pixels up to cone size and single specks, like the segmentation writes them
+cv::Mat randomMask(cv::RNG &rng, int rows, int cols) {
+    cv::Mat mask(rows, cols, CV_8UC1, cv::Scalar::all(0));
+    const int blobs = rng.uniform(0, 12);
+    for (int i = 0; i < blobs; i++) {
+        const cv::Point centre(rng.uniform(0, cols), rng.uniform(0, rows));
+        const cv::Size axes(rng.uniform(1, 20), rng.uniform(1, 30));
+        cv::ellipse(mask, centre, axes, rng.uniform(0, 180), 0, 360, cv::Scalar::all(255), -1);
+    }
+    const int specks = rng.uniform(0, rows * cols / 50 + 1);
+    for (int i = 0; i < specks; i++) {
+        mask.at<uint8_t>(rng.uniform(0, rows), rng.uniform(0, cols)) = static_cast<uint8_t>(rng.uniform(1, 256));
+    }
+    return mask;
+}
+
+std::string sizeName(const cv::Mat &mask) {
+    return std::to_string(mask.rows) + "x" + std::to_string(mask.cols);
+}
+
+void comparePacked(const std::string &test, const PackedMask &packed, const cv::Mat &expected) {
+    cv::Mat unpacked;
+    packed.unpack(unpacked);
+    cv::Mat binary = (expected != 0);
+    if (unpacked.size() != expected.size()) {
+        fail(test, "size " + std::to_string(packed.rows()) + "x" + std::to_string(packed.cols()) + " instead of " + sizeName(expected));
+        return;
+    }
+    const int differing = cv::countNonZero(unpacked != binary);
+    if (differing != 0) {
+        fail(test, std::to_string(differing) + " pixels differ on a " + sizeName(expected) + " mask");
+    }
+    for (int y = 0; y < packed.rows() && packed.wordsPerRow() > 0; y++) {
+        if ((packed.row(y)[packed.wordsPerRow() - 1] & ~packed.lastWordMask()) != 0) {
+            fail(test, "bits past the end of row " + std::to_string(y) + " are set");
+            return;
+        }
+    }
+}
+
+void testPackRow(cv::RNG &rng) {
+    // Odd offsets into the buffer, so that the 16-byte loads are unaligned as well
+    std::vector<uint8_t> bytes(300);
+    std::vector<uint64_t> words(6);
+    for (int width = 1; width <= 260; width++) {
+        const int offset = width % 7;
+        for (int x = 0; x < width; x++) {
+            bytes[offset + x] = (rng.uniform(0, 3) == 0) ? static_cast<uint8_t>(rng.uniform(1, 256)) : 0;
+        }
+        words.assign(words.size(), ~static_cast<uint64_t>(0));
+        packRow(&bytes[offset], width, words.data());
+        for (int x = 0; x < (width + 63) / 64 * 64; x++) {
+            const bool bit = ((words[x / 64] >> (x % 64)) & 1) != 0;
+            const bool expected = (x < width) && (bytes[offset + x] != 0);
+            if (bit != expected) {
+                fail("packRow", "bit " + std::to_string(x) + " of a row of " + std::to_string(width) + " px is wrong");
+                break;
+            }
+        }
+    }
+}
+
+void testMorphology(const cv::Mat &mask) {
+    PackedMask packed;
+    PackedMask scratch;
+    PackedMask result;
+    packed.pack(mask);
+    comparePacked("pack", packed, mask);
+
+    cv::Mat expected;
+    erodePacked(packed, result);
+    cv::erode(mask, expected, cv::Mat());
+    comparePacked("erodePacked", result, expected);
+
+    dilatePacked(packed, result);
+    cv::dilate(mask, expected, cv::Mat());
+    comparePacked("dilatePacked", result, expected);
+
+    cv::Mat opened;
+    openClosePacked(packed, scratch, result);
+    openCloseMask(mask, opened, expected);
+    comparePacked("openClosePacked", result, expected);
+}
+
+void testBlobs(cv::RNG &rng, const cv::Mat &mask) {
+    PackedMask packed;
+    packed.pack(mask);
+    ComponentBuffers buffers{};
+    std::vector<ConeBlob> expected;
+    std::vector<ConeBlob> blobs;
+    const int minArea = rng.uniform(1, 20);
+    const size_t maxBlobs = static_cast<size_t>(rng.uniform(1, 70));
+    const cv::Point offset(rng.uniform(0, 100), rng.uniform(0, 300));
+    extractBlobs(mask, minArea, maxBlobs, offset, buffers, expected);
+    extractBlobs(packed, minArea, maxBlobs, offset, buffers, blobs);
+
+    const std::string test = "extractBlobs on a " + sizeName(mask) + " mask";
+    if (blobs.size() != expected.size()) {
+        fail(test, std::to_string(blobs.size()) + " blobs instead of " + std::to_string(expected.size()));
+        return;
+    }
+    for (size_t i = 0; i < blobs.size(); i++) {
+        //The centroids are divided in double and rounded to float on both sides
+        const bool sameCentroid = std::fabs(blobs[i].centroid.x - expected[i].centroid.x) < 1e-3f
+            && std::fabs(blobs[i].centroid.y - expected[i].centroid.y) < 1e-3f;
+        if (blobs[i].area != expected[i].area || !sameCentroid || blobs[i].box != expected[i].box) {
+            fail(test, "blob " + std::to_string(i) + " has area " + std::to_string(blobs[i].area) + " instead of "
+                 + std::to_string(expected[i].area) + " or a different centroid or box");
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    cv::RNG rng(20200318);
+    testPackRow(rng);
+    //Widths below, at and past a word, and the ROI of the default sliders
+    const cv::Size sizes[] = {cv::Size(1, 1), cv::Size(63, 5), cv::Size(64, 17), cv::Size(65, 40), cv::Size(130, 3),
+                              cv::Size(200, 1), cv::Size(1, 90), cv::Size(640, 145), cv::Size(640, 480)};
+    for (const cv::Size &size : sizes) {
+        for (int i = 0; i < 20; i++) {
+            const cv::Mat mask = randomMask(rng, size.height, size.width);
+            testMorphology(mask);
+            testBlobs(rng, mask);
+        }
+    }
+    if (failures == 0) {
+        std::cout << "packed masks match the CV_8UC1 functions" << std::endl;
+    }
+    return (failures == 0) ? 0 : 1;
+}
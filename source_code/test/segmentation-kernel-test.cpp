@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020  Christian Berger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares every row kernel of the fused segmentation that this CPU supports with segmentRowScalar(): on all
+// 2^24 BGR colours, and on random frames whose widths are at, below and above multiples of the 8 and 16 pixels
+// of the SSE4.1 and AVX2 loops, so that their scalar tails run as well. Prints every difference and returns 1
+// if there was one.
+
+#include "cone-segmentation.hpp"
+#include "packed-mask.hpp"
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void fail(const std::string &test, const std::string &what) {
+    std::cerr << test << ": " << what << std::endl;
+    failures++;
+}
+
+// The bounds of the sliders of the service, and wider ones so that more pixels land in both masks
+const HsvRange BLUE{42, 99, 44, 155, 200, 79};
+const HsvRange YELLOW{18, 101, 104, 53, 255, 255};
+const HsvRange WIDE_BLUE{90, 30, 30, 140, 255, 255};
+const HsvRange WIDE_YELLOW{0, 0, 0, 60, 255, 255};
+
+// Random BGRA pixels; every few pixels is grey or has two equal maximum channels, the special cases of the hue
+cv::Mat randomFrame(cv::RNG &rng, int rows, int cols) {
+    cv::Mat frame(rows, cols, CV_8UC4);
+    rng.fill(frame, cv::RNG::UNIFORM, 0, 256);
+    for (int y = 0; y < rows; y++) {
+        uint8_t *pixel = frame.ptr<uint8_t>(y);
+        for (int x = 0; x < cols; x++, pixel += 4) {
+            switch (rng.uniform(0, 8)) {
+                case 0:
+                    pixel[1] = pixel[2] = pixel[0];
+                    break;
+                case 1:
+                    pixel[2] = pixel[1];
+                    break;
+                case 2:
+                    pixel[0] = pixel[2];
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return frame;
+}
+
+std::string frameName(SegmentationKernel kernel, const cv::Mat &frame) {
+    return std::string(segmentationKernelName(kernel)) + " on a " + std::to_string(frame.rows) + "x" + std::to_string(frame.cols) + " frame";
+}
+
+void compareKernel(SegmentationKernel kernel, const cv::Mat &frame, const HsvRange &blue, const HsvRange &yellow) {
+    cv::Mat blueMask;
+    cv::Mat yellowMask;
+    segmentConesFused(frame, blue, yellow, blueMask, yellowMask, kernel);
+    PackedMask bluePacked;
+    PackedMask yellowPacked;
+    segmentConesFusedPacked(frame, blue, yellow, bluePacked, yellowPacked, kernel);
+    cv::Mat blueUnpacked;
+    cv::Mat yellowUnpacked;
+    bluePacked.unpack(blueUnpacked);
+    yellowPacked.unpack(yellowUnpacked);
+
+    std::vector<uint8_t> blueRef(static_cast<size_t>(frame.cols));
+    std::vector<uint8_t> yellowRef(static_cast<size_t>(frame.cols));
+    for (int y = 0; y < frame.rows; y++) {
+        segmentRowScalar(frame.ptr<uint8_t>(y), 4, frame.cols, blue, yellow, blueRef.data(), yellowRef.data());
+        for (int x = 0; x < frame.cols; x++) {
+            const size_t i = static_cast<size_t>(x);
+            const bool byteMasks = blueMask.at<uint8_t>(y, x) == blueRef[i] && yellowMask.at<uint8_t>(y, x) == yellowRef[i];
+            const bool packedBits = (blueUnpacked.at<uint8_t>(y, x) != 0) == (blueRef[i] != 0)
+                && (yellowUnpacked.at<uint8_t>(y, x) != 0) == (yellowRef[i] != 0);
+            if (!byteMasks || !packedBits) {
+                const uint8_t *pixel = frame.ptr<uint8_t>(y) + 4 * x;
+                fail(frameName(kernel, frame), std::string(byteMasks ? "packed" : "byte") + " masks differ at " + std::to_string(x) + ","
+                     + std::to_string(y) + " (BGR " + std::to_string(pixel[0]) + " " + std::to_string(pixel[1]) + " "
+                     + std::to_string(pixel[2]) + ")");
+                return;
+            }
+        }
+    }
+}
+
+// One 256x256 frame per blue value holds every green and red value
+void compareAllColours(SegmentationKernel kernel, const HsvRange &blue, const HsvRange &yellow) {
+    const int failuresBefore = failures;
+    cv::Mat frame(256, 256, CV_8UC4);
+    for (int b = 0; b < 256 && failures == failuresBefore; b++) {
+        for (int g = 0; g < 256; g++) {
+            uint8_t *pixel = frame.ptr<uint8_t>(g);
+            for (int r = 0; r < 256; r++, pixel += 4) {
+                pixel[0] = static_cast<uint8_t>(b);
+                pixel[1] = static_cast<uint8_t>(g);
+                pixel[2] = static_cast<uint8_t>(r);
+                pixel[3] = 255;
+            }
+        }
+        compareKernel(kernel, frame, blue, yellow);
+    }
+}
+
+}  // namespace
+
+int main() {
+    cv::RNG rng(20200318);
+    const SegmentationKernel kernels[] = {SegmentationKernel::Scalar, SegmentationKernel::Sse41, SegmentationKernel::Avx2};
+    //Below, at and above one and several vector widths, the ROI of the default sliders and a full frame
+    const int widths[] = {1, 3, 7, 8, 9, 15, 16, 17, 23, 24, 25, 31, 32, 33, 63, 64, 65, 127, 640};
+    for (SegmentationKernel kernel : kernels) {
+        if (!segmentationKernelSupported(kernel)) {
+            std::cout << segmentationKernelName(kernel) << " kernel not supported by this CPU, skipped" << std::endl;
+            continue;
+        }
+        compareAllColours(kernel, BLUE, YELLOW);
+        compareAllColours(kernel, WIDE_BLUE, WIDE_YELLOW);
+        for (int width : widths) {
+            for (int i = 0; i < 4; i++) {
+                const cv::Mat frame = randomFrame(rng, rng.uniform(1, 20), width);
+                compareKernel(kernel, frame, BLUE, YELLOW);
+                compareKernel(kernel, frame, WIDE_BLUE, WIDE_YELLOW);
+            }
+        }
+        std::cout << segmentationKernelName(kernel) << " kernel checked" << std::endl;
+    }
+    if (failures == 0) {
+        std::cout << "segmentation kernels match the scalar reference" << std::endl;
+    }
+    return (failures == 0) ? 0 : 1;
+}